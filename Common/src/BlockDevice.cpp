@@ -0,0 +1,82 @@
+#include "BlockDevice.h"
+#include "FileBlockDevice.h"
+#include "MappedBlockDevice.h"
+#include "UringBlockDevice.h"
+
+BlockDevice* BlockDevice::Open(const std::string& image, BlockDeviceType type)
+{
+	if (type == BlockDeviceType::Mapped)
+	{
+		MappedBlockDevice* device = new MappedBlockDevice(image);
+
+		if (!device->IsOpen())
+		{
+			delete device;
+			return nullptr;
+		}
+
+		return device;
+	}
+
+	FileBlockDevice* device = nullptr;
+	if (type == BlockDeviceType::Uring)
+	{
+		device = new UringBlockDevice(image);
+	}
+	else
+	{
+		device = new FileBlockDevice(image);
+	}
+
+	if (!device->IsOpen())
+	{
+		delete device;
+		return nullptr;
+	}
+
+	return device;
+}
+
+int BlockDevice::ReadBatch(BlockIO* requests, uint32_t count)
+{
+	int ret = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (Read(requests[i].offset, requests[i].buffer, requests[i].size) != 0)
+		{
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+int BlockDevice::ReadVector(uint64_t offset, const IOSegment* segments, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (segments[i].buffer && Read(offset, segments[i].buffer, segments[i].size) != 0)
+		{
+			return -1;
+		}
+
+		offset += segments[i].size;
+	}
+
+	return 0;
+}
+
+int BlockDevice::WriteVector(uint64_t offset, const IOSegment* segments, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (segments[i].buffer && Write(offset, segments[i].buffer, segments[i].size) != 0)
+		{
+			return -1;
+		}
+
+		offset += segments[i].size;
+	}
+
+	return 0;
+}
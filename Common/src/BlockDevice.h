@@ -0,0 +1,64 @@
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+#include <stdint.h>
+#include <string>
+
+enum class BlockDeviceType
+{
+	File, //pread/pwrite on the image
+	Mapped, //the whole image is memory mapped, reads can be served without copying
+	Uring //pread/pwrite, with batched reads submitted through io_uring (falls back to File where that's not available)
+};
+
+struct BlockIO
+{
+	uint64_t offset;
+	void* buffer;
+	uint64_t size;
+};
+
+//One piece of a vectored transfer, the pieces of a transfer follow each other on the device
+//A segment without a buffer is skipped, that part of the device is neither read nor written
+struct IOSegment
+{
+	void* buffer;
+	uint64_t size;
+};
+
+//Byte addressed view of a disk image, shared by all the filesystem drivers
+//Every access carries its own offset, there is no stream position, so reads and writes don't have to seek first
+class BlockDevice
+{
+public:
+	virtual ~BlockDevice() {}
+
+	//Both return 0 on success and -1 if the whole range couldn't be transferred
+	virtual int Read(uint64_t offset, void* buffer, uint64_t size) = 0;
+	virtual int Write(uint64_t offset, const void* buffer, uint64_t size) = 0;
+
+	//Reads every request, the device is free to have all of them in flight at once and complete them in any order
+	//Returns 0 if all of them succeeded
+	virtual int ReadBatch(BlockIO* requests, uint32_t count);
+
+	//Scatter/gather versions of Read and Write, the range starting at offset is split between the segments in order
+	virtual int ReadVector(uint64_t offset, const IOSegment* segments, uint32_t count);
+	virtual int WriteVector(uint64_t offset, const IOSegment* segments, uint32_t count);
+
+	//Hint that the range will be read soon, the device may start loading it in the background
+	virtual void Prefetch(uint64_t /*offset*/, uint64_t /*size*/) {}
+
+	virtual int Flush() = 0;
+
+	virtual uint64_t GetSize() const = 0;
+
+	//Returns a pointer to the range inside the device's memory mapping, or nullptr if the device isn't mapped
+	//Writing through the pointer modifies the image, the change is made persistent by Flush
+	virtual uint8_t* Map(uint64_t /*offset*/, uint64_t /*size*/) { return nullptr; }
+
+public:
+	//Returns nullptr if the image couldn't be opened
+	static BlockDevice* Open(const std::string& image, BlockDeviceType type = BlockDeviceType::File);
+};
+
+#endif
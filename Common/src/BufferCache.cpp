@@ -0,0 +1,627 @@
+#include "BufferCache.h"
+
+#include <algorithm>
+#include <string.h>
+
+//Copies size bytes between data and the segments, starting position bytes into them, skipped segments are left out
+//Returns how many bytes were actually copied
+static uint64_t CopySegments(const IOSegment* segments, uint32_t count, uint64_t position, uint8_t* data, uint64_t size, bool toSegments)
+{
+	uint64_t copied = 0;
+	uint64_t segmentStart = 0;
+	for (uint32_t i = 0; i < count && size; i++)
+	{
+		uint64_t segmentEnd = segmentStart + segments[i].size;
+		if (position < segmentEnd)
+		{
+			uint64_t from = position - segmentStart;
+			uint64_t length = segmentEnd - position;
+			if (length > size)
+			{
+				length = size;
+			}
+
+			if (segments[i].buffer)
+			{
+				uint8_t* segment = (uint8_t*)segments[i].buffer + from;
+				memcpy(toSegments ? segment : data, toSegments ? data : segment, length);
+				copied += length;
+			}
+
+			position += length;
+			data += length;
+			size -= length;
+		}
+
+		segmentStart = segmentEnd;
+	}
+
+	return copied;
+}
+
+//The segments covering size bytes starting position bytes into the list
+static void SliceSegments(const IOSegment* segments, uint32_t count, uint64_t position, uint64_t size, std::vector<IOSegment>& out)
+{
+	out.clear();
+
+	uint64_t segmentStart = 0;
+	for (uint32_t i = 0; i < count && size; i++)
+	{
+		uint64_t segmentEnd = segmentStart + segments[i].size;
+		if (position < segmentEnd)
+		{
+			uint64_t from = position - segmentStart;
+			uint64_t length = segmentEnd - position;
+			if (length > size)
+			{
+				length = size;
+			}
+
+			out.push_back({ segments[i].buffer ? (uint8_t*)segments[i].buffer + from : nullptr, length });
+
+			position += length;
+			size -= length;
+		}
+
+		segmentStart = segmentEnd;
+	}
+}
+
+BufferCache::BufferCache(uint64_t capacity)
+	: capacity(capacity)
+{
+}
+
+BufferCache::~BufferCache()
+{
+}
+
+BufferCache& BufferCache::Shared()
+{
+	static BufferCache cache;
+	return cache;
+}
+
+int BufferCache::Read(BlockDevice* device, uint64_t offset, void* buffer, uint64_t size)
+{
+	//A mapped image already sits in the page cache, keeping a second copy would only cost memory
+	if (device->Map(offset, size))
+	{
+		return device->Read(offset, buffer, size);
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	BlockKey key = { device, offset };
+	auto it = lookup.find(key);
+	if (it != lookup.end() && it->second->data.size() >= size)
+	{
+		stats.hits++;
+		blocks.splice(blocks.begin(), blocks, it->second);
+		memcpy(buffer, it->second->data.data(), size);
+		return 0;
+	}
+
+	stats.misses++;
+	if (device->Read(offset, buffer, size) != 0)
+	{
+		return -1;
+	}
+
+	if (it != lookup.end() && it->second->dirty)
+	{
+		//A smaller dirty copy is newer than the disk, it's merged into what was read
+		//It has to be written out before the bigger block replaces it, if that fails it stays and the read isn't cached
+		memcpy(buffer, it->second->data.data(), it->second->data.size());
+		if (WriteOut(*it->second) != 0)
+		{
+			return 0;
+		}
+	}
+
+	Insert(key, buffer, size);
+	return 0;
+}
+
+int BufferCache::Write(BlockDevice* device, uint64_t offset, const void* buffer, uint64_t size)
+{
+	if (device->Map(offset, size))
+	{
+		return device->Write(offset, buffer, size);
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	BlockKey key = { device, offset };
+	auto it = lookup.find(key);
+	if (it != lookup.end())
+	{
+		if (it->second->data.size() == size)
+		{
+			blocks.splice(blocks.begin(), blocks, it->second);
+			memcpy(it->second->data.data(), buffer, size);
+			MarkClean(*it->second);
+		}
+		else
+		{
+			//Written with a different size, the old copy is stale now, but the part of a dirty one this write doesn't cover isn't on the disk yet
+			if (WriteOut(*it->second) != 0)
+			{
+				return -1;
+			}
+
+			Remove(it->second);
+		}
+	}
+
+	return device->Write(offset, buffer, size);
+}
+
+int BufferCache::WriteRange(BlockDevice* device, uint64_t offset, const void* buffer, uint64_t size, uint64_t blockSize)
+{
+	if (device->Map(offset, size))
+	{
+		return device->Write(offset, buffer, size);
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	const uint8_t* data = (const uint8_t*)buffer;
+	for (uint64_t position = 0; position < size; position += blockSize)
+	{
+		auto it = lookup.find({ device, offset + position });
+		if (it == lookup.end())
+		{
+			continue;
+		}
+
+		uint64_t length = size - position;
+		if (length > blockSize)
+		{
+			length = blockSize;
+		}
+
+		if (it->second->data.size() == length)
+		{
+			memcpy(it->second->data.data(), data + position, length);
+			MarkClean(*it->second);
+		}
+		else
+		{
+			if (WriteOut(*it->second) != 0)
+			{
+				return -1;
+			}
+
+			Remove(it->second);
+		}
+	}
+
+	return device->Write(offset, buffer, size);
+}
+
+int BufferCache::WriteBack(BlockDevice* device, uint64_t offset, const void* buffer, uint64_t size, BlockKind kind)
+{
+	//Stores to a mapping already are write-back, msync takes care of them
+	if (device->Map(offset, size))
+	{
+		return device->Write(offset, buffer, size);
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	BlockKey key = { device, offset };
+	auto it = lookup.find(key);
+
+	std::list<Block>::iterator block;
+	if (it != lookup.end() && it->second->data.size() == size)
+	{
+		block = it->second;
+		blocks.splice(blocks.begin(), blocks, block);
+		memcpy(block->data.data(), buffer, size);
+	}
+	else
+	{
+		//A dirty copy of a different size can't be merged, it goes out first
+		if (it != lookup.end() && WriteOut(*it->second) != 0)
+		{
+			return -1;
+		}
+
+		block = Insert(key, buffer, size);
+		if (block == blocks.end())
+		{
+			return device->Write(offset, buffer, size);
+		}
+	}
+
+	if (!block->dirty)
+	{
+		block->dirty = true;
+		dirtyBytes[device] += size;
+	}
+
+	//The kind only ever gets promoted, a block that held metadata once is flushed with the metadata
+	if (kind == BlockKind::Metadata)
+	{
+		block->kind = BlockKind::Metadata;
+	}
+
+	return 0;
+}
+
+int BufferCache::ReadBatch(BlockDevice* device, BlockIO* requests, uint32_t count, uint64_t blockSize)
+{
+	//Reused by every call on the thread (the cache is shared between threads), a read only allocates while they keep getting bigger
+	thread_local std::vector<BlockIO> misses;
+	misses.clear();
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			BlockIO& request = requests[i];
+			uint8_t* buffer = (uint8_t*)request.buffer;
+
+			//Blocks that aren't cached are collected into runs, a cached block ends the run before it
+			uint64_t runStart = 0;
+			uint64_t position = 0;
+			while (position < request.size)
+			{
+				uint64_t length = request.size - position;
+				if (length > blockSize)
+				{
+					length = blockSize;
+				}
+
+				auto it = lookup.find({ device, request.offset + position });
+				if (it != lookup.end() && it->second->data.size() >= length)
+				{
+					stats.hits++;
+					blocks.splice(blocks.begin(), blocks, it->second);
+					memcpy(buffer + position, it->second->data.data(), length);
+
+					if (position > runStart)
+					{
+						misses.push_back({ request.offset + runStart, buffer + runStart, position - runStart });
+					}
+
+					runStart = position + length;
+				}
+
+				position += length;
+			}
+
+			if (position > runStart)
+			{
+				misses.push_back({ request.offset + runStart, buffer + runStart, position - runStart });
+			}
+		}
+	}
+
+	if (misses.size() == 0)
+	{
+		return 0;
+	}
+
+	return device->ReadBatch(misses.data(), (uint32_t)misses.size());
+}
+
+int BufferCache::ReadVector(BlockDevice* device, uint64_t offset, const IOSegment* segments, uint32_t count, uint64_t blockSize)
+{
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		total += segments[i].size;
+	}
+
+	if (device->Map(offset, total))
+	{
+		return device->ReadVector(offset, segments, count);
+	}
+
+	//Runs of blocks that have to come from the device, as [start, end) positions in the segments
+	//Reused like the misses of ReadBatch
+	thread_local std::vector<std::pair<uint64_t, uint64_t>> runs;
+	runs.clear();
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		uint64_t runStart = 0;
+		uint64_t position = 0;
+		while (position < total)
+		{
+			uint64_t length = total - position;
+			if (length > blockSize)
+			{
+				length = blockSize;
+			}
+
+			auto it = lookup.find({ device, offset + position });
+			if (it != lookup.end() && it->second->data.size() >= length)
+			{
+				stats.hits++;
+				blocks.splice(blocks.begin(), blocks, it->second);
+				CopySegments(segments, count, position, it->second->data.data(), length, true);
+
+				if (position > runStart)
+				{
+					runs.push_back({ runStart, position });
+				}
+
+				runStart = position + length;
+			}
+
+			position += length;
+		}
+
+		if (position > runStart)
+		{
+			runs.push_back({ runStart, position });
+		}
+	}
+
+	if (runs.size() == 1 && runs[0].first == 0)
+	{
+		return device->ReadVector(offset, segments, count);
+	}
+
+	thread_local std::vector<IOSegment> slice;
+	for (auto& run : runs)
+	{
+		SliceSegments(segments, count, run.first, run.second - run.first, slice);
+		if (device->ReadVector(offset + run.first, slice.data(), (uint32_t)slice.size()) != 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int BufferCache::WriteVector(BlockDevice* device, uint64_t offset, const IOSegment* segments, uint32_t count, uint64_t blockSize)
+{
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		total += segments[i].size;
+	}
+
+	if (device->Map(offset, total))
+	{
+		return device->WriteVector(offset, segments, count);
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	for (uint64_t position = 0; position < total; position += blockSize)
+	{
+		auto it = lookup.find({ device, offset + position });
+		if (it == lookup.end())
+		{
+			continue;
+		}
+
+		uint64_t length = total - position;
+		if (length > blockSize)
+		{
+			length = blockSize;
+		}
+
+		if (it->second->data.size() == length)
+		{
+			//A block that is only partially written keeps the rest of its cached bytes, and whether they are dirty
+			if (CopySegments(segments, count, position, it->second->data.data(), length, false) == length)
+			{
+				MarkClean(*it->second);
+			}
+		}
+		else
+		{
+			if (WriteOut(*it->second) != 0)
+			{
+				return -1;
+			}
+
+			Remove(it->second);
+		}
+	}
+
+	return device->WriteVector(offset, segments, count);
+}
+
+int BufferCache::Sync(BlockDevice* device, BlockKind kind)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	std::vector<Block*> dirty;
+	for (auto& block : blocks)
+	{
+		if (block.dirty && block.key.device == device && block.kind == kind)
+		{
+			dirty.push_back(&block);
+		}
+	}
+
+	std::sort(dirty.begin(), dirty.end(), [](const Block* a, const Block* b) { return a->key.offset < b->key.offset; });
+
+	int ret = 0;
+	std::vector<uint8_t> run;
+	for (size_t i = 0; i < dirty.size();)
+	{
+		//Find the run of blocks that follow each other on the disk
+		size_t end = i + 1;
+		uint64_t runSize = dirty[i]->data.size();
+		while (end < dirty.size() && dirty[end]->key.offset == dirty[i]->key.offset + runSize && runSize + dirty[end]->data.size() <= maxTransfer)
+		{
+			runSize += dirty[end]->data.size();
+			end++;
+		}
+
+		int written = 0;
+		if (end == i + 1)
+		{
+			written = device->Write(dirty[i]->key.offset, dirty[i]->data.data(), runSize);
+		}
+		else
+		{
+			run.resize(runSize);
+
+			uint64_t pos = 0;
+			for (size_t j = i; j < end; j++)
+			{
+				memcpy(run.data() + pos, dirty[j]->data.data(), dirty[j]->data.size());
+				pos += dirty[j]->data.size();
+			}
+
+			written = device->Write(dirty[i]->key.offset, run.data(), runSize);
+		}
+
+		//A run that couldn't be written stays dirty, the next Sync tries it again
+		if (written != 0)
+		{
+			ret = -1;
+			i = end;
+			continue;
+		}
+
+		for (size_t j = i; j < end; j++)
+		{
+			MarkClean(*dirty[j]);
+			stats.writebacks++;
+		}
+
+		i = end;
+	}
+
+	//The blocks just written can go now, if the dirty ones kept the cache over its capacity
+	Evict();
+	return ret;
+}
+
+bool BufferCache::NeedsSync(BlockDevice* device)
+{
+	return GetDirtyBytes(device) >= dirtyThreshold;
+}
+
+uint64_t BufferCache::GetDirtyBytes(BlockDevice* device)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	auto it = dirtyBytes.find(device);
+	if (it == dirtyBytes.end())
+	{
+		return 0;
+	}
+
+	return it->second;
+}
+
+void BufferCache::Invalidate(BlockDevice* device)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	for (auto it = blocks.begin(); it != blocks.end();)
+	{
+		auto next = std::next(it);
+		if (it->key.device == device)
+		{
+			Remove(it);
+		}
+
+		it = next;
+	}
+
+	dirtyBytes.erase(device);
+}
+
+void BufferCache::SetCapacity(uint64_t capacity)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	this->capacity = capacity;
+	Evict();
+}
+
+std::list<BufferCache::Block>::iterator BufferCache::Insert(const BlockKey& key, const void* data, uint64_t size)
+{
+	auto it = lookup.find(key);
+	if (it != lookup.end())
+	{
+		Remove(it->second);
+	}
+
+	//Blocks bigger than the whole cache aren't worth keeping
+	if (size > capacity)
+	{
+		return blocks.end();
+	}
+
+	blocks.push_front({ key, std::vector<uint8_t>((const uint8_t*)data, (const uint8_t*)data + size), false, BlockKind::Data });
+	lookup[key] = blocks.begin();
+	this->size += size;
+
+	//The new block is at the front, so it can't be the one evicted
+	Evict();
+	return blocks.begin();
+}
+
+void BufferCache::Remove(std::list<Block>::iterator block)
+{
+	MarkClean(*block);
+
+	size -= block->data.size();
+	lookup.erase(block->key);
+	blocks.erase(block);
+}
+
+int BufferCache::WriteOut(Block& block)
+{
+	if (!block.dirty)
+	{
+		return 0;
+	}
+
+	if (block.key.device->Write(block.key.offset, block.data.data(), block.data.size()) != 0)
+	{
+		return -1;
+	}
+
+	MarkClean(block);
+	stats.writebacks++;
+	return 0;
+}
+
+void BufferCache::MarkClean(Block& block)
+{
+	if (!block.dirty)
+	{
+		return;
+	}
+
+	block.dirty = false;
+	block.kind = BlockKind::Data;
+	dirtyBytes[block.key.device] -= block.data.size();
+}
+
+void BufferCache::Evict()
+{
+	//The front block is the one just used, it's never evicted
+	auto end = blocks.end();
+	while (size > capacity && end != blocks.begin() && std::prev(end) != blocks.begin())
+	{
+		auto last = std::prev(end);
+
+		//Writing a dirty block here would put it on the disk out of order, it stays until Sync trims the cache
+		if (last->dirty)
+		{
+			end = last;
+			continue;
+		}
+
+		Remove(last);
+		stats.evictions++;
+	}
+}
@@ -0,0 +1,139 @@
+#ifndef BUFFER_CACHE_H
+#define BUFFER_CACHE_H
+
+#include "BlockDevice.h"
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct BufferCacheStats
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t writebacks;
+};
+
+//Decides the order dirty blocks reach the disk in: file data first, then the structures pointing to it
+enum class BlockKind
+{
+	Data,
+	Metadata
+};
+
+//Size bounded LRU cache of device blocks (sectors, clusters or ext2 blocks), shared by every driver
+//A block is identified by its device and the byte offset it starts at, so the same cache can hold blocks of different sizes
+//Write goes straight to the device, WriteBack only marks the cached copy dirty, it only reaches the device on Sync
+//Dirty blocks are never evicted, the cache may go over its capacity with them until the next Sync
+class BufferCache
+{
+public:
+	BufferCache(uint64_t capacity = DefaultCapacity);
+	~BufferCache();
+
+	//Reads size bytes at offset, from the cache if possible, otherwise from the device and the block is cached
+	int Read(BlockDevice* device, uint64_t offset, void* buffer, uint64_t size);
+	//Writes through to the device, the cached copy (if there is one) is updated as well
+	int Write(BlockDevice* device, uint64_t offset, const void* buffer, uint64_t size);
+	//Writes a run of consecutive blocks with a single device write, the cached copies of the blocks in it are updated
+	int WriteRange(BlockDevice* device, uint64_t offset, const void* buffer, uint64_t size, uint64_t blockSize);
+	//Only updates the cache, the block is written to the device by Sync
+	int WriteBack(BlockDevice* device, uint64_t offset, const void* buffer, uint64_t size, BlockKind kind = BlockKind::Data);
+
+	//Scatter/gather Read and Write of consecutive blocks starting at offset, skipped segments let a block be transferred partially
+	//Blocks that are cached are copied from (or patched in) memory, the rest goes to the device vectored, nothing new is cached
+	int ReadVector(BlockDevice* device, uint64_t offset, const IOSegment* segments, uint32_t count, uint64_t blockSize);
+	int WriteVector(BlockDevice* device, uint64_t offset, const IOSegment* segments, uint32_t count, uint64_t blockSize);
+
+	//Writes the device's dirty blocks of the given kind in ascending offset order, adjacent blocks are merged into one write
+	int Sync(BlockDevice* device, BlockKind kind);
+
+	//True once the device has more dirty bytes than the threshold, the driver should Sync then
+	bool NeedsSync(BlockDevice* device);
+	uint64_t GetDirtyBytes(BlockDevice* device);
+
+	//Serves whatever it can from the cache and hands the rest to the device in one batch
+	//Requests start on a block boundary and may span several blocks, cached blocks in the middle of one split it up
+	//File data read this way isn't added to the cache, so a big read doesn't push out all the metadata
+	int ReadBatch(BlockDevice* device, BlockIO* requests, uint32_t count, uint64_t blockSize);
+
+	//Drops every block of the device, has to be called before the device is closed
+	//Dirty blocks are lost, so the device has to be synced first
+	void Invalidate(BlockDevice* device);
+
+	void SetCapacity(uint64_t capacity);
+	uint64_t GetCapacity() const { return capacity; }
+	uint64_t GetSize() const { return size; }
+
+	void SetDirtyThreshold(uint64_t threshold) { dirtyThreshold = threshold; }
+	uint64_t GetDirtyThreshold() const { return dirtyThreshold; }
+
+	//Upper limit of a single merged transfer, both for Sync and for the drivers coalescing contiguous clusters
+	void SetMaxTransfer(uint64_t bytes) { maxTransfer = bytes; }
+	uint64_t GetMaxTransfer() const { return maxTransfer; }
+
+	BufferCacheStats GetStats() const { return stats; }
+
+public:
+	//The cache all the drivers use by default
+	static BufferCache& Shared();
+
+	static const uint64_t DefaultCapacity = 8 * 1024 * 1024;
+	static const uint64_t DefaultDirtyThreshold = 2 * 1024 * 1024;
+	static const uint64_t DefaultMaxTransfer = 1024 * 1024;
+
+private:
+	struct BlockKey
+	{
+		BlockDevice* device;
+		uint64_t offset;
+
+		bool operator==(const BlockKey& other) const { return device == other.device && offset == other.offset; }
+	};
+
+	struct BlockKeyHash
+	{
+		size_t operator()(const BlockKey& key) const
+		{
+			return std::hash<uint64_t>()(key.offset) ^ (std::hash<void*>()(key.device) << 1);
+		}
+	};
+
+	struct Block
+	{
+		BlockKey key;
+		std::vector<uint8_t> data;
+
+		bool dirty;
+		BlockKind kind;
+	};
+
+	//These assume the lock is held
+	//A dirty block already cached at key has to be written out by the caller first, Insert drops it
+	std::list<Block>::iterator Insert(const BlockKey& key, const void* data, uint64_t size);
+	void Remove(std::list<Block>::iterator block);
+	//Writes a dirty block to the device and marks it clean, on failure it stays dirty
+	int WriteOut(Block& block);
+	void MarkClean(Block& block);
+	void Evict();
+
+private:
+	//Most recently used block at the front
+	std::list<Block> blocks;
+	std::unordered_map<BlockKey, std::list<Block>::iterator, BlockKeyHash> lookup;
+
+	uint64_t capacity;
+	uint64_t size = 0;
+
+	uint64_t dirtyThreshold = DefaultDirtyThreshold;
+	uint64_t maxTransfer = DefaultMaxTransfer;
+	std::unordered_map<BlockDevice*, uint64_t> dirtyBytes;
+
+	BufferCacheStats stats = {};
+
+	std::mutex lock;
+};
+
+#endif
@@ -0,0 +1,181 @@
+#include "ClusterAllocator.h"
+
+ClusterAllocator::ClusterAllocator(uint32_t first, uint32_t count)
+	: first(first), count(count)
+{
+	used.resize((count + 63) / 64, ~0ull);
+}
+
+void ClusterAllocator::MarkFree(uint32_t start, uint32_t length)
+{
+	for (uint32_t cluster = start; cluster < start + length; cluster++)
+	{
+		SetUsed(cluster, false);
+	}
+
+	freeCount += length;
+
+	//Runs come in ascending order, so only the previous extent can touch this one
+	auto last = extents.empty() ? extents.end() : std::prev(extents.end());
+	if (last != extents.end() && last->first + last->second == start)
+	{
+		start = last->first;
+		length += last->second;
+		RemoveExtent(last);
+	}
+
+	AddExtent(start, length);
+}
+
+bool ClusterAllocator::Allocate(uint32_t count, uint32_t hint, std::vector<uint32_t>& clusters)
+{
+	if (count == 0)
+	{
+		return true;
+	}
+
+	if (count > freeCount)
+	{
+		return false;
+	}
+
+	//Continue from the hint if it's free, even if that extent is too short, the rest comes from elsewhere
+	if (IsFree(hint))
+	{
+		auto extent = extents.upper_bound(hint);
+		extent--;
+
+		uint32_t available = extent->first + extent->second - hint;
+		uint32_t length = (available < count) ? available : count;
+
+		Take(extent, hint, length, clusters);
+		count -= length;
+	}
+
+	while (count)
+	{
+		//Smallest extent that holds all of it, if there's none, the biggest one
+		auto fit = bySize.lower_bound({ count, 0 });
+		if (fit == bySize.end())
+		{
+			fit = std::prev(bySize.end());
+		}
+
+		auto extent = extents.find(fit->second);
+		uint32_t length = (extent->second < count) ? extent->second : count;
+
+		Take(extent, extent->first, length, clusters);
+		count -= length;
+	}
+
+	return true;
+}
+
+void ClusterAllocator::Free(uint32_t cluster)
+{
+	if (cluster < first || cluster >= first + count || IsFree(cluster))
+	{
+		return;
+	}
+
+	SetUsed(cluster, false);
+	freeCount++;
+
+	uint32_t start = cluster;
+	uint32_t length = 1;
+
+	//Merge with the extent ending right before it
+	auto next = extents.upper_bound(cluster);
+	if (next != extents.begin())
+	{
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == cluster)
+		{
+			start = prev->first;
+			length += prev->second;
+			RemoveExtent(prev);
+		}
+	}
+
+	//and the one starting right after it
+	if (next != extents.end() && next->first == cluster + 1)
+	{
+		length += next->second;
+		RemoveExtent(next);
+	}
+
+	AddExtent(start, length);
+}
+
+bool ClusterAllocator::IsFree(uint32_t cluster) const
+{
+	if (cluster < first || cluster >= first + count)
+	{
+		return false;
+	}
+
+	uint32_t index = cluster - first;
+	return !((used[index / 64] >> (index % 64)) & 1);
+}
+
+uint32_t ClusterAllocator::GetFirstFree() const
+{
+	if (extents.empty())
+	{
+		return 0;
+	}
+
+	return extents.begin()->first;
+}
+
+void ClusterAllocator::AddExtent(uint32_t start, uint32_t length)
+{
+	extents[start] = length;
+	bySize.insert({ length, start });
+}
+
+void ClusterAllocator::RemoveExtent(std::map<uint32_t, uint32_t>::iterator extent)
+{
+	bySize.erase({ extent->second, extent->first });
+	extents.erase(extent);
+}
+
+void ClusterAllocator::Take(std::map<uint32_t, uint32_t>::iterator extent, uint32_t start, uint32_t length, std::vector<uint32_t>& clusters)
+{
+	uint32_t extentStart = extent->first;
+	uint32_t extentLength = extent->second;
+	RemoveExtent(extent);
+
+	//Whatever is left on either side stays free
+	if (start > extentStart)
+	{
+		AddExtent(extentStart, start - extentStart);
+	}
+
+	uint32_t end = start + length;
+	if (end < extentStart + extentLength)
+	{
+		AddExtent(end, extentStart + extentLength - end);
+	}
+
+	for (uint32_t cluster = start; cluster < end; cluster++)
+	{
+		SetUsed(cluster, true);
+		clusters.push_back(cluster);
+	}
+
+	freeCount -= length;
+}
+
+void ClusterAllocator::SetUsed(uint32_t cluster, bool used)
+{
+	uint32_t index = cluster - first;
+	if (used)
+	{
+		this->used[index / 64] |= (1ull << (index % 64));
+	}
+	else
+	{
+		this->used[index / 64] &= ~(1ull << (index % 64));
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef CLUSTER_ALLOCATOR_H
+#define CLUSTER_ALLOCATOR_H
+
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+//In-memory free space index: a bitmap of the used clusters, plus a tree of the free extents
+//Allocations are served from a single free extent whenever one is big enough, so files stay contiguous,
+//and neither allocating nor freeing depends on the size of the volume
+class ClusterAllocator
+{
+public:
+	//Manages the clusters first ... first + count - 1, all of them start out used
+	ClusterAllocator(uint32_t first, uint32_t count);
+
+	//Only meant for building the index: marks a run of used clusters free, runs have to come in ascending order
+	void MarkFree(uint32_t start, uint32_t length);
+
+	//Fills clusters with count clusters, in the order they should be chained
+	//If hint is free, the allocation starts there (to extend a chain in place), otherwise the smallest free extent that fits is used
+	//Returns false and allocates nothing if there isn't enough free space
+	bool Allocate(uint32_t count, uint32_t hint, std::vector<uint32_t>& clusters);
+	void Free(uint32_t cluster);
+
+	bool IsFree(uint32_t cluster) const;
+
+	uint32_t GetFreeCount() const { return freeCount; }
+	uint32_t GetFirstFree() const;
+
+private:
+	void AddExtent(uint32_t start, uint32_t length);
+	void RemoveExtent(std::map<uint32_t, uint32_t>::iterator extent);
+	void Take(std::map<uint32_t, uint32_t>::iterator extent, uint32_t start, uint32_t length, std::vector<uint32_t>& clusters);
+
+	void SetUsed(uint32_t cluster, bool used);
+
+private:
+	uint32_t first;
+	uint32_t count;
+
+	//One bit per cluster, set if it's in use
+	std::vector<uint64_t> used;
+	uint32_t freeCount = 0;
+
+	//Free extents by their first cluster, and the same extents by (length, first cluster) for best fit lookups
+	std::map<uint32_t, uint32_t> extents;
+	std::set<std::pair<uint32_t, uint32_t>> bySize;
+};
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef DENTRY_CACHE_H
+#define DENTRY_CACHE_H
+
+#include <stdint.h>
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+//(parent directory, name) -> entry pairs of the path components resolved lately, so opening a deep path doesn't search every directory on it again
+//A name that wasn't found is remembered too, until something is created with that name
+//Entry is the driver's DirEntry, the least recently used pairs are dropped once there are MaxEntries of them
+template<typename Entry>
+class DentryCache
+{
+public:
+	enum class Result
+	{
+		Unknown, //Nothing cached, the directory has to be searched
+		Found,
+		NotFound
+	};
+
+	Result Lookup(uint64_t parent, const char* name, Entry* entry)
+	{
+		auto it = entries.find(Key{ parent, name });
+		if (it == entries.end())
+		{
+			return Result::Unknown;
+		}
+
+		lru.splice(lru.begin(), lru, it->second);
+
+		Node& node = *it->second;
+		if (node.negative)
+		{
+			return Result::NotFound;
+		}
+
+		if (entry != nullptr)
+		{
+			*entry = node.entry;
+		}
+
+		return Result::Found;
+	}
+
+	//location is where the entry itself is stored (the cluster or inode it's in), that's what a modification of it names
+	void Insert(uint64_t parent, const char* name, const Entry& entry, uint64_t location)
+	{
+		Node& node = Add(parent, name);
+		node.negative = false;
+		node.entry = entry;
+		node.location = location;
+		locations[Key{ location, name }] = lru.begin();
+	}
+
+	void InsertNegative(uint64_t parent, const char* name)
+	{
+		Node& node = Add(parent, name);
+		node.negative = true;
+	}
+
+	//Something called name was created in (or removed from) parent
+	void Remove(uint64_t parent, const char* name)
+	{
+		auto it = entries.find(Key{ parent, name });
+		if (it != entries.end())
+		{
+			Erase(it->second);
+		}
+	}
+
+	//The entry stored at location was modified or deleted
+	void RemoveAt(uint64_t location, const char* name)
+	{
+		auto it = locations.find(Key{ location, name });
+		if (it != locations.end())
+		{
+			Erase(it->second);
+		}
+	}
+
+	//The directory was deleted, nothing in it is valid anymore (its cluster or inode may be reused)
+	void RemoveDirectory(uint64_t parent)
+	{
+		for (auto it = lru.begin(); it != lru.end();)
+		{
+			auto next = std::next(it);
+			if (it->key.parent == parent)
+			{
+				Erase(it);
+			}
+
+			it = next;
+		}
+	}
+
+	void Clear()
+	{
+		lru.clear();
+		entries.clear();
+		locations.clear();
+	}
+
+public:
+	static const uint32_t MaxEntries = 1024;
+
+private:
+	struct Key
+	{
+		uint64_t parent;
+		std::string name;
+
+		bool operator==(const Key& other) const { return parent == other.parent && name == other.name; }
+	};
+
+	struct KeyHash
+	{
+		size_t operator()(const Key& key) const { return std::hash<std::string>()(key.name) ^ (size_t)(key.parent * 0x9E3779B97F4A7C15ull); }
+	};
+
+	struct Node
+	{
+		Key key;
+		bool negative;
+		uint64_t location;
+		Entry entry;
+	};
+
+	typedef typename std::list<Node>::iterator NodeIt;
+
+	//Returns the node of (parent, name) moved to the front, a new one if it wasn't cached
+	Node& Add(uint64_t parent, const char* name)
+	{
+		Key key{ parent, name };
+		auto it = entries.find(key);
+		if (it != entries.end())
+		{
+			NodeIt node = it->second;
+			if (!node->negative)
+			{
+				locations.erase(Key{ node->location, node->key.name });
+			}
+
+			lru.splice(lru.begin(), lru, node);
+			return *node;
+		}
+
+		if (entries.size() >= MaxEntries)
+		{
+			Erase(std::prev(lru.end()));
+		}
+
+		lru.push_front(Node{ key, true, 0, Entry() });
+		entries[key] = lru.begin();
+		return lru.front();
+	}
+
+	void Erase(NodeIt node)
+	{
+		if (!node->negative)
+		{
+			auto loc = locations.find(Key{ node->location, node->key.name });
+			if (loc != locations.end() && loc->second == node)
+			{
+				locations.erase(loc);
+			}
+		}
+
+		entries.erase(node->key);
+		lru.erase(node);
+	}
+
+private:
+	std::list<Node> lru; //Most recently used first
+	std::unordered_map<Key, NodeIt, KeyHash> entries;
+	std::unordered_map<Key, NodeIt, KeyHash> locations;
+};
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef DIRECTORY_INDEX_H
+#define DIRECTORY_INDEX_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <unordered_map>
+#include <vector>
+
+//Name -> entry hash maps of the directories that were searched, so finding a name doesn't decode the whole directory again
+//Entry is the driver's DirEntry, it only needs a name member
+//Names are keyed by their case folded hash and compared exactly on lookup, so case sensitive filesystems can use it too
+template<typename Entry>
+class DirectoryIndex
+{
+public:
+	bool IsIndexed(uint64_t directory) const
+	{
+		return directories.find(directory) != directories.end();
+	}
+
+	//Returns the entry called name, nullptr if there's none or the directory isn't indexed
+	Entry* Find(uint64_t directory, const char* name)
+	{
+		auto dir = directories.find(directory);
+		if (dir == directories.end())
+		{
+			return nullptr;
+		}
+
+		auto range = dir->second.entries.equal_range(FoldHash(name));
+		for (auto it = range.first; it != range.second; it++)
+		{
+			if (strcmp(it->second.name, name) == 0)
+			{
+				return &it->second;
+			}
+		}
+
+		return nullptr;
+	}
+
+	//Indexes every entry of the directory
+	//parts are the clusters the directory is made of, on FAT an entry only knows which one of them it's in
+	void Build(uint64_t directory, const std::vector<Entry>& entries, const std::vector<uint32_t>& parts = {})
+	{
+		Invalidate(directory);
+
+		if (directories.size() >= MaxDirectories)
+		{
+			Invalidate(directories.begin()->first);
+		}
+
+		Directory& dir = directories[directory];
+		dir.entries.reserve(entries.size());
+		for (const Entry& entry : entries)
+		{
+			dir.entries.insert({ FoldHash(entry.name), entry });
+		}
+
+		for (uint32_t part : parts)
+		{
+			AddPart(part, directory);
+		}
+	}
+
+	//Both do nothing if the directory isn't indexed, it's going to be read whole when it's searched next
+	void Insert(uint64_t directory, const Entry& entry)
+	{
+		auto dir = directories.find(directory);
+		if (dir != directories.end())
+		{
+			dir->second.entries.insert({ FoldHash(entry.name), entry });
+		}
+	}
+
+	void Remove(uint64_t directory, const char* name)
+	{
+		auto dir = directories.find(directory);
+		if (dir == directories.end())
+		{
+			return;
+		}
+
+		auto range = dir->second.entries.equal_range(FoldHash(name));
+		for (auto it = range.first; it != range.second; it++)
+		{
+			if (strcmp(it->second.name, name) == 0)
+			{
+				dir->second.entries.erase(it);
+				return;
+			}
+		}
+	}
+
+	//A cluster was added to the directory (it grew)
+	void AddPart(uint32_t part, uint64_t directory)
+	{
+		auto dir = directories.find(directory);
+		if (dir != directories.end())
+		{
+			dir->second.parts.push_back(part);
+			owners[part] = directory;
+		}
+	}
+
+	//The indexed directory part belongs to, or part itself if no indexed directory has it (a directory's first cluster is the directory)
+	uint64_t GetDirectory(uint32_t part) const
+	{
+		auto it = owners.find(part);
+		return (it != owners.end()) ? it->second : part;
+	}
+
+	void Invalidate(uint64_t directory)
+	{
+		auto dir = directories.find(directory);
+		if (dir == directories.end())
+		{
+			return;
+		}
+
+		for (uint32_t part : dir->second.parts)
+		{
+			owners.erase(part);
+		}
+
+		directories.erase(dir);
+	}
+
+	void Clear()
+	{
+		directories.clear();
+		owners.clear();
+	}
+
+	//FNV-1a of the name with ASCII folding (what FAT treats as case insensitive), so no key has to be stored besides the entry
+	static uint64_t FoldHash(const char* name)
+	{
+		uint64_t hash = 0xCBF29CE484222325ull;
+		for (const char* c = name; *c; c++)
+		{
+			char folded = (*c >= 'a' && *c <= 'z') ? (*c - ('a' - 'A')) : *c;
+			hash = (hash ^ (uint8_t)folded) * 0x100000001B3ull;
+		}
+
+		return hash;
+	}
+
+public:
+	static const uint32_t MaxDirectories = 64;
+
+private:
+	struct Directory
+	{
+		std::unordered_multimap<uint64_t, Entry> entries;
+		std::vector<uint32_t> parts;
+	};
+
+	std::unordered_map<uint64_t, Directory> directories;
+	std::unordered_map<uint32_t, uint64_t> owners;
+};
+
+#endif
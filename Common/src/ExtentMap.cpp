@@ -0,0 +1,48 @@
+#include "ExtentMap.h"
+
+#include <algorithm>
+
+void ExtentMap::Append(uint64_t physical)
+{
+	if (extents.size())
+	{
+		//Holes only merge with holes, nothing is contiguous with a hole
+		Extent& last = extents.back();
+		bool hole = (physical == 0);
+		if ((last.physical == 0) == hole && (hole || last.physical + last.length == physical))
+		{
+			last.length++;
+			length++;
+			return;
+		}
+	}
+
+	extents.push_back({ length, physical, 1 });
+	length++;
+}
+
+uint64_t ExtentMap::Lookup(uint64_t logical, uint64_t* contiguous) const
+{
+	if (logical >= length)
+	{
+		return 0;
+	}
+
+	//The last run starting at or before logical
+	auto it = std::upper_bound(extents.begin(), extents.end(), logical, [](uint64_t value, const Extent& extent) { return value < extent.logical; });
+	it--;
+
+	uint64_t offset = logical - it->logical;
+	if (contiguous)
+	{
+		*contiguous = it->length - offset;
+	}
+
+	return (it->physical != 0) ? (it->physical + offset) : 0;
+}
+
+void ExtentMap::Clear()
+{
+	extents.clear();
+	length = 0;
+}
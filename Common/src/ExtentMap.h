@@ -0,0 +1,38 @@
+#ifndef EXTENT_MAP_H
+#define EXTENT_MAP_H
+
+#include <stdint.h>
+
+#include <vector>
+
+//A run of logically consecutive units (clusters or blocks) that are physically consecutive as well
+struct Extent
+{
+	uint64_t logical;
+	uint64_t physical;
+	uint64_t length;
+};
+
+//Run-length encoded logical to physical mapping of a file, looked up in O(log runs)
+//Physical unit 0 is a hole (a sparse file's unallocated block), a run of holes is looked up as 0
+class ExtentMap
+{
+public:
+	//Maps the next logical unit, it's merged into the last run if it follows it on the disk
+	void Append(uint64_t physical);
+
+	//Returns the physical unit, and how many units after it (including itself) are contiguous (or holes)
+	//Returns 0 if logical is past the end of the map
+	uint64_t Lookup(uint64_t logical, uint64_t* contiguous = nullptr) const;
+
+	void Clear();
+
+	uint64_t GetLength() const { return length; }
+	const std::vector<Extent>& GetExtents() const { return extents; }
+
+private:
+	std::vector<Extent> extents;
+	uint64_t length = 0;
+};
+
+#endif
@@ -0,0 +1,224 @@
+#include "FATCache.h"
+
+#include <algorithm>
+#include <vector>
+#include <string.h>
+
+FATCache::FATCache(BlockDevice* device, uint64_t offset, uint64_t size, uint32_t sectorSize, uint32_t copies, uint32_t activeCopy, uint64_t budget)
+	: device(device), offset(offset), size(size), sectorSize(sectorSize), copies(copies), activeCopy(activeCopy)
+{
+	pageSize = (uint64_t)sectorSize * SectorsPerPage;
+	this->budget = (budget < pageSize) ? pageSize : budget;
+}
+
+FATCache::~FATCache()
+{
+	for (auto& page : pages)
+	{
+		delete[] page.data;
+	}
+}
+
+uint32_t FATCache::Get(uint32_t index)
+{
+	uint64_t position = (uint64_t)index * sizeof(uint32_t);
+	if (position >= size)
+	{
+		return -1;
+	}
+
+	Page* page = GetPage(position / pageSize);
+	if (page == nullptr)
+	{
+		return -1;
+	}
+
+	return *(uint32_t*)(page->data + position % pageSize);
+}
+
+void FATCache::Set(uint32_t index, uint32_t value)
+{
+	uint64_t position = (uint64_t)index * sizeof(uint32_t);
+	if (position >= size)
+	{
+		return;
+	}
+
+	Page* page = GetPage(position / pageSize);
+	if (page == nullptr)
+	{
+		return;
+	}
+
+	uint32_t* entry = (uint32_t*)(page->data + position % pageSize);
+	if (*entry == value)
+	{
+		return;
+	}
+
+	*entry = value;
+
+	uint64_t bit = 1ull << ((position % pageSize) / sectorSize);
+	if (!(page->dirty & bit))
+	{
+		page->dirty |= bit;
+		dirtyCount++;
+	}
+}
+
+int FATCache::Flush()
+{
+	if (dirtyCount == 0)
+	{
+		return 0;
+	}
+
+	//Write in table order, so the disk sees ascending offsets
+	std::vector<Page*> dirtyPages;
+	for (auto& page : pages)
+	{
+		if (page.dirty)
+		{
+			dirtyPages.push_back(&page);
+		}
+	}
+
+	std::sort(dirtyPages.begin(), dirtyPages.end(), [](const Page* a, const Page* b) { return a->index < b->index; });
+
+	int ret = 0;
+	for (Page* page : dirtyPages)
+	{
+		if (FlushPage(*page) != 0)
+		{
+			ret = -1;
+		}
+	}
+
+	//The pages that were kept over the budget because they were dirty can go now
+	Evict();
+	return ret;
+}
+
+void FATCache::SetBudget(uint64_t budget)
+{
+	this->budget = (budget < pageSize) ? pageSize : budget;
+	Evict();
+}
+
+FATCache::Page* FATCache::GetPage(uint64_t index)
+{
+	if (lastPage && lastPage->index == index)
+	{
+		return lastPage;
+	}
+
+	auto it = lookup.find(index);
+	if (it != lookup.end())
+	{
+		pages.splice(pages.begin(), pages, it->second);
+		lastPage = &pages.front();
+		return lastPage;
+	}
+
+	uint64_t start = index * pageSize;
+	uint64_t length = pageSize;
+	if (start + length > size)
+	{
+		length = size - start;
+	}
+
+	uint8_t* data = new uint8_t[pageSize];
+	memset(data, 0, pageSize);
+	if (device->Read(offset + size * activeCopy + start, data, length) != 0)
+	{
+		delete[] data;
+		return nullptr;
+	}
+
+	pages.push_front({ index, data, 0 });
+	lookup[index] = pages.begin();
+	lastPage = &pages.front();
+
+	Evict();
+	return lastPage;
+}
+
+int FATCache::FlushPage(Page& page)
+{
+	uint64_t sectors = SectorsPerPage;
+	uint64_t pageStart = page.index * pageSize;
+
+	int ret = 0;
+	uint64_t sector = 0;
+	while (sector < sectors)
+	{
+		if (!(page.dirty & (1ull << sector)))
+		{
+			sector++;
+			continue;
+		}
+
+		uint64_t first = sector;
+		while (sector < sectors && (page.dirty & (1ull << sector)))
+		{
+			sector++;
+		}
+
+		uint64_t start = pageStart + first * sectorSize;
+		uint64_t length = (sector - first) * sectorSize;
+		if (start + length > size)
+		{
+			length = size - start;
+		}
+
+		bool written = true;
+		for (uint32_t i = 0; i < copies; i++)
+		{
+			if (device->Write(offset + size * i + start, page.data + first * sectorSize, length) != 0)
+			{
+				written = false;
+			}
+		}
+
+		if (!written)
+		{
+			ret = -1;
+			continue;
+		}
+
+		for (uint64_t s = first; s < sector; s++)
+		{
+			page.dirty &= ~(1ull << s);
+		}
+
+		dirtyCount -= sector - first;
+	}
+
+	return ret;
+}
+
+void FATCache::Evict()
+{
+	//Only clean pages are dropped, a dirty one would reach the disk ahead of the data its entries point to
+	//The budget can be exceeded by dirty pages until the next Flush, which trims the cache again
+	//The page at the front was just used, it always stays
+	auto end = pages.end();
+	while (pages.size() * pageSize > budget && end != pages.begin() && std::prev(end) != pages.begin())
+	{
+		auto last = std::prev(end);
+		if (last->dirty)
+		{
+			end = last;
+			continue;
+		}
+
+		if (lastPage == &*last)
+		{
+			lastPage = nullptr;
+		}
+
+		delete[] last->data;
+		lookup.erase(last->index);
+		pages.erase(last);
+	}
+}
@@ -0,0 +1,76 @@
+#ifndef FAT_CACHE_H
+#define FAT_CACHE_H
+
+#include "BlockDevice.h"
+
+#include <list>
+#include <unordered_map>
+
+//Demand-paged cache of a 32 bit File Allocation Table (FAT32 and exFAT)
+//The table is loaded a page at a time when an entry on it is first touched, and clean pages are dropped once the memory budget is used up
+//Dirty pages are never dropped, they stay (even over the budget) until Flush, so the FAT never reaches the disk ahead of the data
+//Every sector remembers whether it's been modified, so flushing only writes what changed, to every copy of the FAT
+class FATCache
+{
+public:
+	//offset and size describe the first FAT, the other copies follow it directly
+	//activeCopy is the copy that's read, exFAT can switch to the second one
+	FATCache(BlockDevice* device, uint64_t offset, uint64_t size, uint32_t sectorSize, uint32_t copies, uint32_t activeCopy = 0, uint64_t budget = DefaultBudget);
+	~FATCache();
+
+	uint32_t Get(uint32_t index);
+	void Set(uint32_t index, uint32_t value);
+
+	//Writes the dirty sectors to every FAT copy, neighbouring dirty sectors go out as one write
+	//Returns 0 on success, the sectors that couldn't be written stay dirty
+	int Flush();
+
+	bool IsDirty() const { return dirtyCount != 0; }
+	uint64_t GetEntryCount() const { return size / sizeof(uint32_t); }
+
+	//The budget can't go below a single page
+	void SetBudget(uint64_t budget);
+	uint64_t GetBudget() const { return budget; }
+	uint64_t GetLoadedBytes() const { return pages.size() * pageSize; }
+
+public:
+	static const uint64_t DefaultBudget = 16 * 1024 * 1024;
+
+	//Sectors in a page, one bit each in the page's dirty mask
+	static const uint32_t SectorsPerPage = 64;
+
+private:
+	struct Page
+	{
+		uint64_t index;
+		uint8_t* data;
+		uint64_t dirty; //bit n is set if sector n of the page was modified
+	};
+
+	Page* GetPage(uint64_t index);
+	int FlushPage(Page& page);
+	void Evict();
+
+private:
+	BlockDevice* device;
+
+	uint64_t offset;
+	uint64_t size;
+	uint32_t sectorSize;
+	uint32_t copies;
+	uint32_t activeCopy;
+
+	uint64_t pageSize;
+	uint64_t budget;
+
+	//Most recently used page at the front
+	std::list<Page> pages;
+	std::unordered_map<uint64_t, std::list<Page>::iterator> lookup;
+
+	//Chain walks hit the same page over and over, this skips the lookup for them
+	Page* lastPage = nullptr;
+
+	uint64_t dirtyCount = 0;
+};
+
+#endif
@@ -0,0 +1,261 @@
+#include "FileBlockDevice.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <errno.h>
+#endif
+
+#ifdef _WIN32
+
+FileBlockDevice::FileBlockDevice(const std::string& image)
+{
+	handle = ::CreateFileA(image.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		handle = nullptr;
+		return;
+	}
+
+	LARGE_INTEGER fileSize;
+	if (::GetFileSizeEx(handle, &fileSize))
+	{
+		size = (uint64_t)fileSize.QuadPart;
+	}
+}
+
+FileBlockDevice::~FileBlockDevice()
+{
+	if (handle)
+	{
+		::CloseHandle(handle);
+	}
+}
+
+bool FileBlockDevice::IsOpen() const
+{
+	return handle != nullptr;
+}
+
+int FileBlockDevice::Read(uint64_t offset, void* buffer, uint64_t size)
+{
+	uint8_t* buf = (uint8_t*)buffer;
+	while (size)
+	{
+		//The offset goes into the OVERLAPPED structure, the handle's file pointer is never used
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+		DWORD toRead = (size > 0x40000000) ? 0x40000000 : (DWORD)size;
+		DWORD read = 0;
+		if (!::ReadFile(handle, buf, toRead, &read, &overlapped) || read == 0)
+		{
+			return -1;
+		}
+
+		buf += read;
+		offset += read;
+		size -= read;
+	}
+
+	return 0;
+}
+
+int FileBlockDevice::Write(uint64_t offset, const void* buffer, uint64_t size)
+{
+	const uint8_t* buf = (const uint8_t*)buffer;
+	while (size)
+	{
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+		DWORD toWrite = (size > 0x40000000) ? 0x40000000 : (DWORD)size;
+		DWORD written = 0;
+		if (!::WriteFile(handle, buf, toWrite, &written, &overlapped) || written == 0)
+		{
+			return -1;
+		}
+
+		buf += written;
+		offset += written;
+		size -= written;
+	}
+
+	return 0;
+}
+
+int FileBlockDevice::Flush()
+{
+	return ::FlushFileBuffers(handle) ? 0 : -1;
+}
+
+#else
+
+FileBlockDevice::FileBlockDevice(const std::string& image)
+{
+	fd = ::open(image.c_str(), O_RDWR);
+
+	if (fd < 0)
+	{
+		return;
+	}
+
+	struct stat st;
+	if (::fstat(fd, &st) == 0)
+	{
+		size = (uint64_t)st.st_size;
+	}
+}
+
+FileBlockDevice::~FileBlockDevice()
+{
+	if (fd >= 0)
+	{
+		::close(fd);
+	}
+}
+
+bool FileBlockDevice::IsOpen() const
+{
+	return fd >= 0;
+}
+
+int FileBlockDevice::Read(uint64_t offset, void* buffer, uint64_t size)
+{
+	uint8_t* buf = (uint8_t*)buffer;
+	while (size)
+	{
+		ssize_t ret = ::pread(fd, buf, size, (off_t)offset);
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		//Reading past the end of the image is an error as well, the drivers never expect short reads
+		if (ret <= 0)
+		{
+			return -1;
+		}
+
+		buf += ret;
+		offset += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+int FileBlockDevice::Write(uint64_t offset, const void* buffer, uint64_t size)
+{
+	const uint8_t* buf = (const uint8_t*)buffer;
+	while (size)
+	{
+		ssize_t ret = ::pwrite(fd, buf, size, (off_t)offset);
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (ret <= 0)
+		{
+			return -1;
+		}
+
+		buf += ret;
+		offset += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+int FileBlockDevice::Flush()
+{
+	return (::fsync(fd) == 0) ? 0 : -1;
+}
+
+void FileBlockDevice::Prefetch(uint64_t offset, uint64_t size)
+{
+	::posix_fadvise(fd, (off_t)offset, (off_t)size, POSIX_FADV_WILLNEED);
+}
+
+int FileBlockDevice::ReadVector(uint64_t offset, const IOSegment* segments, uint32_t count)
+{
+	return TransferVector(offset, segments, count, false);
+}
+
+int FileBlockDevice::WriteVector(uint64_t offset, const IOSegment* segments, uint32_t count)
+{
+	return TransferVector(offset, segments, count, true);
+}
+
+int FileBlockDevice::TransferVector(uint64_t offset, const IOSegment* segments, uint32_t count, bool write)
+{
+	//Up to this many segments go into one call, on the stack so a transfer doesn't allocate
+	const uint32_t MaxVectors = (IOV_MAX < 64) ? IOV_MAX : 64;
+	struct iovec iov[MaxVectors];
+
+	uint32_t i = 0;
+	while (i < count)
+	{
+		if (segments[i].buffer == nullptr)
+		{
+			offset += segments[i].size;
+			i++;
+			continue;
+		}
+
+		uint32_t used = 0;
+		while (i < count && segments[i].buffer && used < MaxVectors)
+		{
+			if (segments[i].size)
+			{
+				iov[used++] = { segments[i].buffer, (size_t)segments[i].size };
+			}
+
+			i++;
+		}
+
+		//Short transfers continue from the first segment that isn't done yet
+		uint32_t first = 0;
+		while (first < used)
+		{
+			ssize_t ret = write ? ::pwritev(fd, &iov[first], (int)(used - first), (off_t)offset)
+				: ::preadv(fd, &iov[first], (int)(used - first), (off_t)offset);
+			if (ret < 0 && errno == EINTR)
+			{
+				continue;
+			}
+
+			if (ret <= 0)
+			{
+				return -1;
+			}
+
+			offset += ret;
+			while (first < used && (size_t)ret >= iov[first].iov_len)
+			{
+				ret -= iov[first].iov_len;
+				first++;
+			}
+
+			if (ret > 0)
+			{
+				iov[first].iov_base = (uint8_t*)iov[first].iov_base + ret;
+				iov[first].iov_len -= ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+#endif
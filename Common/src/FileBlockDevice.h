@@ -0,0 +1,48 @@
+#ifndef FILE_BLOCK_DEVICE_H
+#define FILE_BLOCK_DEVICE_H
+
+#include "BlockDevice.h"
+
+//BlockDevice on top of a raw file descriptor (a HANDLE on Windows), using pread/pwrite style positional I/O
+class FileBlockDevice : public BlockDevice
+{
+public:
+	FileBlockDevice(const std::string& image);
+	~FileBlockDevice();
+
+	int Read(uint64_t offset, void* buffer, uint64_t size) override;
+	int Write(uint64_t offset, const void* buffer, uint64_t size) override;
+
+#ifndef _WIN32
+	//preadv/pwritev, every run of segments between two skipped ones is a single call
+	int ReadVector(uint64_t offset, const IOSegment* segments, uint32_t count) override;
+	int WriteVector(uint64_t offset, const IOSegment* segments, uint32_t count) override;
+#endif
+
+#ifndef _WIN32
+	//posix_fadvise(WILLNEED), the kernel reads the range into the page cache asynchronously
+	void Prefetch(uint64_t offset, uint64_t size) override;
+#endif
+
+	int Flush() override;
+
+	uint64_t GetSize() const override { return size; }
+
+	bool IsOpen() const;
+
+protected:
+#ifdef _WIN32
+	void* handle;
+#else
+	int fd;
+#endif
+
+	uint64_t size = 0;
+
+#ifndef _WIN32
+private:
+	int TransferVector(uint64_t offset, const IOSegment* segments, uint32_t count, bool write);
+#endif
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef INODE_CACHE_H
+#define INODE_CACHE_H
+
+#include <stdint.h>
+
+#include <list>
+#include <unordered_map>
+
+//Inodes by number, so reading one again (or reading it twice in a row) doesn't go to the disk
+//Every Acquire and Insert takes a reference, an inode is only dropped once it has none and it's among the least recently used ones
+//Writes only modify the cached copy and mark it dirty, the driver writes it back when it's dropped or on Flush
+//Inode is the filesystem's on-disk inode structure
+template<typename Inode>
+class InodeCache
+{
+public:
+	//Returns the cached inode with a reference taken, nullptr if it isn't cached
+	Inode* Acquire(uint64_t number)
+	{
+		auto it = inodes.find(number);
+		if (it == inodes.end())
+		{
+			return nullptr;
+		}
+
+		lru.splice(lru.begin(), lru, it->second);
+		it->second->references++;
+		return &it->second->inode;
+	}
+
+	//Caches the inode (just read from the disk) with a reference taken
+	//The returned pointer stays valid as long as there's a reference to it
+	Inode* Insert(uint64_t number, const Inode& inode)
+	{
+		lru.push_front(Node{ number, 1, false, inode });
+		inodes[number] = lru.begin();
+		return &lru.front().inode;
+	}
+
+	void Release(uint64_t number)
+	{
+		auto it = inodes.find(number);
+		if (it != inodes.end() && it->second->references > 0)
+		{
+			it->second->references--;
+		}
+	}
+
+	//The cached copy was modified, it has to be written back
+	void MarkDirty(uint64_t number)
+	{
+		auto it = inodes.find(number);
+		if (it != inodes.end())
+		{
+			it->second->dirty = true;
+		}
+	}
+
+	//Calls write(number, inode) with every dirty inode, they are clean afterwards
+	template<typename Write>
+	void Flush(Write write)
+	{
+		for (Node& node : lru)
+		{
+			if (node.dirty)
+			{
+				write(node.number, node.inode);
+				node.dirty = false;
+			}
+		}
+	}
+
+	//Drops unreferenced inodes, least recently used first, until there are at most MaxInodes, the dirty ones are written by write first
+	template<typename Write>
+	void Trim(Write write)
+	{
+		for (auto it = lru.end(); inodes.size() > MaxInodes && it != lru.begin();)
+		{
+			it--;
+			if (it->references > 0)
+			{
+				continue;
+			}
+
+			if (it->dirty)
+			{
+				write(it->number, it->inode);
+			}
+
+			inodes.erase(it->number);
+			it = lru.erase(it);
+		}
+	}
+
+	void Clear()
+	{
+		lru.clear();
+		inodes.clear();
+	}
+
+	uint32_t GetCount() const { return (uint32_t)inodes.size(); }
+
+public:
+	static const uint32_t MaxInodes = 1024;
+
+private:
+	struct Node
+	{
+		uint64_t number;
+		uint32_t references;
+		bool dirty;
+		Inode inode;
+	};
+
+	typedef typename std::list<Node>::iterator NodeIt;
+
+	std::list<Node> lru; //Most recently used first
+	std::unordered_map<uint64_t, NodeIt> inodes;
+};
+
+#endif
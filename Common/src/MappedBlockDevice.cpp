@@ -0,0 +1,182 @@
+#include "MappedBlockDevice.h"
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+
+MappedBlockDevice::MappedBlockDevice(const std::string& image)
+{
+	handle = ::CreateFileA(image.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		handle = nullptr;
+		return;
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!::GetFileSizeEx(handle, &fileSize) || fileSize.QuadPart == 0)
+	{
+		return;
+	}
+
+	size = (uint64_t)fileSize.QuadPart;
+
+	mappingHandle = ::CreateFileMappingA(handle, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+	if (mappingHandle == nullptr)
+	{
+		return;
+	}
+
+	mapping = (uint8_t*)::MapViewOfFile(mappingHandle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+}
+
+MappedBlockDevice::~MappedBlockDevice()
+{
+	if (mapping)
+	{
+		Flush();
+		::UnmapViewOfFile(mapping);
+	}
+
+	if (mappingHandle)
+	{
+		::CloseHandle(mappingHandle);
+	}
+
+	if (handle)
+	{
+		::CloseHandle(handle);
+	}
+}
+
+int MappedBlockDevice::Flush()
+{
+	if (!::FlushViewOfFile(mapping, 0))
+	{
+		return -1;
+	}
+
+	return ::FlushFileBuffers(handle) ? 0 : -1;
+}
+
+#else
+
+MappedBlockDevice::MappedBlockDevice(const std::string& image)
+{
+	fd = ::open(image.c_str(), O_RDWR);
+
+	if (fd < 0)
+	{
+		return;
+	}
+
+	struct stat st;
+	if (::fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		return;
+	}
+
+	size = (uint64_t)st.st_size;
+
+	void* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+	{
+		return;
+	}
+
+	mapping = (uint8_t*)ptr;
+}
+
+MappedBlockDevice::~MappedBlockDevice()
+{
+	if (mapping)
+	{
+		Flush();
+		::munmap(mapping, size);
+	}
+
+	if (fd >= 0)
+	{
+		::close(fd);
+	}
+}
+
+int MappedBlockDevice::Flush()
+{
+	return (::msync(mapping, size, MS_SYNC) == 0) ? 0 : -1;
+}
+
+#endif
+
+int MappedBlockDevice::Read(uint64_t offset, void* buffer, uint64_t size)
+{
+	uint8_t* src = Map(offset, size);
+	if (src == nullptr)
+	{
+		return -1;
+	}
+
+	if (src != buffer)
+	{
+		memcpy(buffer, src, size);
+	}
+
+	return 0;
+}
+
+int MappedBlockDevice::Write(uint64_t offset, const void* buffer, uint64_t size)
+{
+	uint8_t* dst = Map(offset, size);
+	if (dst == nullptr)
+	{
+		return -1;
+	}
+
+	//The caller may have modified the mapping in place and is just writing it back
+	if (dst != buffer)
+	{
+		memcpy(dst, buffer, size);
+	}
+
+	return 0;
+}
+
+uint8_t* MappedBlockDevice::Map(uint64_t offset, uint64_t size)
+{
+	if ((offset + size) > this->size || (offset + size) < offset)
+	{
+		return nullptr;
+	}
+
+	return mapping + offset;
+}
+
+void MappedBlockDevice::Prefetch(uint64_t offset, uint64_t size)
+{
+	if (Map(offset, size) == nullptr)
+	{
+		return;
+	}
+
+#ifdef _WIN32
+	WIN32_MEMORY_RANGE_ENTRY range;
+	range.VirtualAddress = mapping + offset;
+	range.NumberOfBytes = (SIZE_T)size;
+	::PrefetchVirtualMemory(::GetCurrentProcess(), 1, &range, 0);
+#else
+	//madvise wants a page aligned address
+	uint64_t page = (uint64_t)::sysconf(_SC_PAGESIZE);
+	uint64_t start = offset & ~(page - 1);
+	::madvise(mapping + start, (size_t)(offset + size - start), MADV_WILLNEED);
+#endif
+}
@@ -0,0 +1,40 @@
+#ifndef MAPPED_BLOCK_DEVICE_H
+#define MAPPED_BLOCK_DEVICE_H
+
+#include "BlockDevice.h"
+
+//BlockDevice that maps the whole image into memory
+//Reads and writes are plain memory copies, the kernel's page cache does the caching, and Flush is an msync
+class MappedBlockDevice : public BlockDevice
+{
+public:
+	MappedBlockDevice(const std::string& image);
+	~MappedBlockDevice();
+
+	int Read(uint64_t offset, void* buffer, uint64_t size) override;
+	int Write(uint64_t offset, const void* buffer, uint64_t size) override;
+
+	int Flush() override;
+
+	uint64_t GetSize() const override { return size; }
+
+	uint8_t* Map(uint64_t offset, uint64_t size) override;
+
+	//madvise(WILLNEED) (PrefetchVirtualMemory on Windows), the pages are faulted in before they're touched
+	void Prefetch(uint64_t offset, uint64_t size) override;
+
+	bool IsOpen() const { return mapping != nullptr; }
+
+private:
+#ifdef _WIN32
+	void* handle = nullptr;
+	void* mappingHandle = nullptr;
+#else
+	int fd = -1;
+#endif
+
+	uint8_t* mapping = nullptr;
+	uint64_t size = 0;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#include "NameArena.h"
+
+#include <string.h>
+
+const char* NameArena::Intern(const char* name)
+{
+	std::string_view view(name);
+
+	auto it = names.find(view);
+	if (it != names.end())
+	{
+		return it->data();
+	}
+
+	uint64_t length = view.size() + 1;
+	if (chunkUsed + length > ChunkSize)
+	{
+		//A name longer than a chunk gets one of its own, the next name starts a new one after it
+		chunks.emplace_back(new char[(length > ChunkSize) ? length : ChunkSize]);
+		chunkUsed = 0;
+	}
+
+	char* stored = chunks.back().get() + chunkUsed;
+	chunkUsed += length;
+
+	memcpy(stored, name, length);
+	size += length;
+
+	names.insert(std::string_view(stored, length - 1));
+	return stored;
+}
+
+void NameArena::Clear()
+{
+	names.clear();
+	chunks.clear();
+	chunkUsed = ChunkSize;
+	size = 0;
+}
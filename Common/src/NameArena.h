@@ -0,0 +1,35 @@
+#ifndef NAME_ARENA_H
+#define NAME_ARENA_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+//Every distinct name stored once, null terminated, in big chunks
+//The returned pointers stay valid until Clear, so entries can keep a pointer instead of a name buffer
+class NameArena
+{
+public:
+	//Returns the stored copy of name, the same pointer for equal names
+	const char* Intern(const char* name);
+
+	void Clear();
+
+	//Bytes of names stored, not counting the unused ends of the chunks
+	uint64_t GetSize() const { return size; }
+
+public:
+	static const uint64_t ChunkSize = 64 * 1024;
+
+private:
+	std::vector<std::unique_ptr<char[]>> chunks;
+	uint64_t chunkUsed = ChunkSize; //Of the last chunk
+	uint64_t size = 0;
+
+	std::unordered_set<std::string_view> names;
+};
+
+#endif
@@ -0,0 +1,62 @@
+#include "Readahead.h"
+
+bool Readahead::Access(uint64_t stream, uint64_t offset, uint64_t size, uint64_t& start, uint64_t& length)
+{
+	uint64_t end = offset + size;
+
+	auto it = streams.find(stream);
+	if (it == streams.end())
+	{
+		if (streams.size() >= MaxStreams)
+		{
+			streams.erase(streams.begin());
+		}
+
+		//A file read from its start is most likely read all the way through
+		it = streams.insert({ stream, { offset, 0, end } }).first;
+		if (offset == 0)
+		{
+			it->second.window = InitialWindow;
+		}
+	}
+	else if (it->second.next == offset)
+	{
+		uint64_t window = it->second.window ? (it->second.window * 2) : InitialWindow;
+		it->second.window = (window > maxWindow) ? maxWindow : window;
+	}
+	else
+	{
+		//Whatever was prefetched past the old position won't be used, the next prefetch starts from here
+		it->second.window /= 2;
+		if (it->second.window < InitialWindow)
+		{
+			it->second.window = 0;
+		}
+
+		it->second.prefetched = end;
+	}
+
+	Stream& s = it->second;
+	s.next = end;
+
+	if (s.prefetched < end)
+	{
+		s.prefetched = end;
+	}
+
+	//Topped up only once less than half the window is left, so a run of small reads doesn't prefetch on every call
+	if (s.window == 0 || (s.prefetched - end) >= (s.window / 2))
+	{
+		return false;
+	}
+
+	start = s.prefetched;
+	length = end + s.window - s.prefetched;
+	s.prefetched = end + s.window;
+	return true;
+}
+
+void Readahead::Forget(uint64_t stream)
+{
+	streams.erase(stream);
+}
@@ -0,0 +1,40 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+
+#include <unordered_map>
+
+//Detects sequential reads per file and decides how far ahead of them the device should prefetch
+//The window doubles every time a read continues where the previous one ended, and halves when it doesn't
+class Readahead
+{
+public:
+	//Called for every read of [offset, offset + size) of a stream (a file, identified by its first cluster or inode)
+	//Returns true if [start, start + length) should be prefetched now, it never overlaps a range handed out earlier
+	bool Access(uint64_t stream, uint64_t offset, uint64_t size, uint64_t& start, uint64_t& length);
+
+	//The stream's file was deleted or rewritten, its history means nothing anymore
+	void Forget(uint64_t stream);
+
+	void SetMaxWindow(uint64_t bytes) { maxWindow = bytes; }
+	uint64_t GetMaxWindow() const { return maxWindow; }
+
+public:
+	static const uint64_t InitialWindow = 128 * 1024;
+	static const uint64_t DefaultMaxWindow = 2 * 1024 * 1024;
+	static const uint32_t MaxStreams = 64;
+
+private:
+	struct Stream
+	{
+		uint64_t next; //Where a sequential read would continue
+		uint64_t window;
+		uint64_t prefetched; //Everything before this was already prefetched (or read)
+	};
+
+	std::unordered_map<uint64_t, Stream> streams;
+	uint64_t maxWindow = DefaultMaxWindow;
+};
+
+#endif
@@ -0,0 +1,58 @@
+#include "ScratchPool.h"
+
+#include <new>
+
+ScratchPool::ScratchPool(uint64_t bufferSize, uint32_t preallocate, uint64_t alignment)
+	: bufferSize(bufferSize), alignment(alignment)
+{
+	buffers.reserve(preallocate);
+	available.reserve(preallocate);
+
+	for (uint32_t i = 0; i < preallocate; i++)
+	{
+		available.push_back(Allocate());
+	}
+}
+
+ScratchPool::~ScratchPool()
+{
+	for (uint8_t* buffer : buffers)
+	{
+		::operator delete[](buffer, std::align_val_t(alignment));
+	}
+}
+
+uint8_t* ScratchPool::Acquire()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (available.size() == 0)
+	{
+		return Allocate();
+	}
+
+	uint8_t* buffer = available.back();
+	available.pop_back();
+	return buffer;
+}
+
+void ScratchPool::Release(uint8_t* buffer)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	//available never needs more room than buffers, so this doesn't allocate either
+	available.push_back(buffer);
+}
+
+uint8_t* ScratchPool::Allocate()
+{
+	uint8_t* buffer = (uint8_t*)::operator new[](bufferSize, std::align_val_t(alignment));
+	buffers.push_back(buffer);
+
+	if (available.capacity() < buffers.size())
+	{
+		available.reserve(buffers.capacity());
+	}
+
+	return buffer;
+}
@@ -0,0 +1,64 @@
+#ifndef SCRATCH_POOL_H
+#define SCRATCH_POOL_H
+
+#include <stdint.h>
+
+#include <mutex>
+#include <vector>
+
+//Aligned buffers of a fixed size (a cluster or a block), each driver has its own pool
+//Buffers go back to the pool instead of the heap, so once every caller had one, partial cluster I/O doesn't allocate anymore
+class ScratchPool
+{
+public:
+	ScratchPool(uint64_t bufferSize, uint32_t preallocate = DefaultPreallocate, uint64_t alignment = DefaultAlignment);
+	~ScratchPool();
+
+	//Only allocates if every buffer is in use
+	uint8_t* Acquire();
+	void Release(uint8_t* buffer);
+
+	uint64_t GetBufferSize() const { return bufferSize; }
+	//How many buffers were ever allocated, stays flat in the steady state
+	uint32_t GetAllocationCount() const { return (uint32_t)buffers.size(); }
+
+public:
+	static const uint32_t DefaultPreallocate = 4;
+	static const uint64_t DefaultAlignment = 4096;
+
+private:
+	uint8_t* Allocate();
+
+private:
+	uint64_t bufferSize;
+	uint64_t alignment;
+
+	std::vector<uint8_t*> buffers;
+	std::vector<uint8_t*> available;
+
+	std::mutex lock;
+};
+
+//Holds a buffer of the pool until it goes out of scope, it can be used wherever a uint8_t* is expected
+class ScratchBuffer
+{
+public:
+	ScratchBuffer(ScratchPool& pool)
+		: pool(pool), buffer(pool.Acquire())
+	{
+	}
+
+	~ScratchBuffer() { pool.Release(buffer); }
+
+	ScratchBuffer(const ScratchBuffer&) = delete;
+	ScratchBuffer& operator=(const ScratchBuffer&) = delete;
+
+	uint8_t* Get() const { return buffer; }
+	operator uint8_t*() const { return buffer; }
+
+private:
+	ScratchPool& pool;
+	uint8_t* buffer;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef SLAB_ARENA_H
+#define SLAB_ARENA_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+//Fixed size objects handed out from big slabs, addressed by index
+//Objects never move, a slab is allocated once SlabSize objects are in use, and everything is released together
+//Objects allocated one after the other are next to each other in memory (unless one starts a new slab)
+template<typename T>
+class SlabArena
+{
+public:
+	//Returns the index of a default constructed object
+	uint32_t Allocate()
+	{
+		if (!freeList.empty())
+		{
+			uint32_t index = freeList.back();
+			freeList.pop_back();
+			return index;
+		}
+
+		if (used == slabs.size() * SlabSize)
+		{
+			slabs.emplace_back(new T[SlabSize]);
+		}
+
+		return used++;
+	}
+
+	//The object is reset and its slot is reused by a later Allocate
+	void Free(uint32_t index)
+	{
+		*Get(index) = T();
+		freeList.push_back(index);
+	}
+
+	T* Get(uint32_t index) const
+	{
+		return &slabs[index / SlabSize][index % SlabSize];
+	}
+
+	//Releases every object, one deallocation per slab
+	void Clear()
+	{
+		slabs.clear();
+		freeList.clear();
+		used = 0;
+	}
+
+	uint32_t GetCount() const { return used - (uint32_t)freeList.size(); }
+
+public:
+	static const uint32_t SlabSize = 4096;
+
+private:
+	std::vector<std::unique_ptr<T[]>> slabs;
+	std::vector<uint32_t> freeList;
+	uint32_t used = 0;
+};
+
+#endif
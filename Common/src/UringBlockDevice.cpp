@@ -0,0 +1,298 @@
+#include "UringBlockDevice.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAS_IO_URING
+#endif
+#endif
+
+#ifdef HAS_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+static int io_uring_setup(uint32_t entries, io_uring_params* params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+UringBlockDevice::UringBlockDevice(const std::string& image, uint32_t queueDepth)
+	: FileBlockDevice(image)
+{
+	if (!IsOpen())
+	{
+		return;
+	}
+
+	io_uring_params params;
+	memset(&params, 0, sizeof(io_uring_params));
+
+	int fd = io_uring_setup(queueDepth, &params);
+	if (fd < 0)
+	{
+		return;
+	}
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	sqEntriesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+	//Newer kernels put both rings into one mapping
+	bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMap)
+	{
+		if (cqRingSize > sqRingSize)
+		{
+			sqRingSize = cqRingSize;
+		}
+
+		cqRingSize = sqRingSize;
+	}
+
+	sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sqRing == MAP_FAILED)
+	{
+		sqRing = nullptr;
+		close(fd);
+		return;
+	}
+
+	if (singleMap)
+	{
+		cqRing = sqRing;
+	}
+	else
+	{
+		cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cqRing == MAP_FAILED)
+		{
+			cqRing = nullptr;
+			munmap(sqRing, sqRingSize);
+			sqRing = nullptr;
+			close(fd);
+			return;
+		}
+	}
+
+	sqEntries = mmap(nullptr, sqEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqEntries == MAP_FAILED)
+	{
+		sqEntries = nullptr;
+		if (cqRing != sqRing)
+		{
+			munmap(cqRing, cqRingSize);
+		}
+		munmap(sqRing, sqRingSize);
+		sqRing = nullptr;
+		cqRing = nullptr;
+		close(fd);
+		return;
+	}
+
+	uint8_t* sq = (uint8_t*)sqRing;
+	sqHead = (uint32_t*)(sq + params.sq_off.head);
+	sqTail = (uint32_t*)(sq + params.sq_off.tail);
+	sqMask = (uint32_t*)(sq + params.sq_off.ring_mask);
+	sqArray = (uint32_t*)(sq + params.sq_off.array);
+
+	uint8_t* cq = (uint8_t*)cqRing;
+	cqHead = (uint32_t*)(cq + params.cq_off.head);
+	cqTail = (uint32_t*)(cq + params.cq_off.tail);
+	cqMask = (uint32_t*)(cq + params.cq_off.ring_mask);
+	cqEntries = cq + params.cq_off.cqes;
+
+	this->queueDepth = params.sq_entries;
+	vectors = new iovec[this->queueDepth];
+	done.resize(this->queueDepth);
+	ringFd = fd;
+}
+
+UringBlockDevice::~UringBlockDevice()
+{
+	CloseRing();
+	delete[] (iovec*)vectors;
+}
+
+void UringBlockDevice::CloseRing()
+{
+	if (ringFd < 0)
+	{
+		return;
+	}
+
+	munmap(sqEntries, sqEntriesSize);
+	if (cqRing != sqRing)
+	{
+		munmap(cqRing, cqRingSize);
+	}
+	munmap(sqRing, sqRingSize);
+
+	close(ringFd);
+	ringFd = -1;
+}
+
+uint32_t UringBlockDevice::Reap(BlockIO* requests, int& ret)
+{
+	io_uring_cqe* cqes = (io_uring_cqe*)cqEntries;
+
+	uint32_t reaped = 0;
+	uint32_t head = *cqHead;
+	while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+	{
+		io_uring_cqe* cqe = &cqes[head & *cqMask];
+		BlockIO& request = requests[cqe->user_data];
+
+		//Short reads and errors are finished off with a plain pread
+		if (cqe->res < 0 || (uint64_t)cqe->res != request.size)
+		{
+			uint64_t finished = (cqe->res < 0) ? 0 : (uint64_t)cqe->res;
+			if (FileBlockDevice::Read(request.offset + finished, (uint8_t*)request.buffer + finished, request.size - finished) != 0)
+			{
+				ret = -1;
+			}
+		}
+
+		done[cqe->user_data] = 1;
+		head++;
+		reaped++;
+	}
+
+	__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+	return reaped;
+}
+
+int UringBlockDevice::ReadBatch(BlockIO* requests, uint32_t count)
+{
+	if (ringFd < 0)
+	{
+		return FileBlockDevice::ReadBatch(requests, count);
+	}
+
+	io_uring_sqe* sqes = (io_uring_sqe*)sqEntries;
+	iovec* iovecs = (iovec*)vectors;
+
+	int ret = 0;
+	uint32_t submitted = 0;
+	while (submitted < count)
+	{
+		uint32_t batch = count - submitted;
+		if (batch > queueDepth)
+		{
+			batch = queueDepth;
+		}
+
+		BlockIO* current = requests + submitted;
+		memset(done.data(), 0, batch);
+
+		uint32_t first = *sqTail;
+		uint32_t tail = first;
+		for (uint32_t i = 0; i < batch; i++)
+		{
+			iovecs[i].iov_base = current[i].buffer;
+			iovecs[i].iov_len = current[i].size;
+
+			uint32_t index = tail & *sqMask;
+			io_uring_sqe* sqe = &sqes[index];
+			memset(sqe, 0, sizeof(io_uring_sqe));
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = fd;
+			sqe->addr = (uint64_t)&iovecs[i];
+			sqe->len = 1;
+			sqe->off = current[i].offset;
+			sqe->user_data = i;
+
+			sqArray[index] = index;
+			tail++;
+		}
+
+		__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+		uint32_t toSubmit = batch;
+		uint32_t completed = 0;
+		bool failed = false;
+		while (completed < batch)
+		{
+			int entered = io_uring_enter(ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS);
+			if (entered < 0 && errno != EINTR)
+			{
+				failed = true;
+				break;
+			}
+
+			if (entered > 0)
+			{
+				toSubmit -= ((uint32_t)entered > toSubmit) ? toSubmit : (uint32_t)entered;
+			}
+
+			completed += Reap(current, ret);
+		}
+
+		if (failed)
+		{
+			//The ring is unusable: the entries the kernel didn't take are withdrawn, the ones it took are waited for
+			uint32_t taken = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+			__atomic_store_n(sqTail, taken, __ATOMIC_RELEASE);
+
+			uint32_t inFlight = (taken - first) - completed;
+			while (inFlight)
+			{
+				inFlight -= Reap(current, ret);
+				if (inFlight && io_uring_enter(ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+				{
+					//They can't be waited for either, closing the ring cancels them (iovecs stays allocated until the device is gone)
+					break;
+				}
+			}
+
+			CloseRing();
+
+			//Whatever didn't complete, and every request after this batch, is read synchronously
+			for (uint32_t i = 0; i < batch; i++)
+			{
+				if (!done[i] && FileBlockDevice::Read(current[i].offset, current[i].buffer, current[i].size) != 0)
+				{
+					ret = -1;
+				}
+			}
+
+			if (FileBlockDevice::ReadBatch(current + batch, count - submitted - batch) != 0)
+			{
+				ret = -1;
+			}
+
+			return ret;
+		}
+
+		submitted += batch;
+	}
+
+	return ret;
+}
+
+#else
+
+UringBlockDevice::UringBlockDevice(const std::string& image, uint32_t queueDepth)
+	: FileBlockDevice(image)
+{
+}
+
+UringBlockDevice::~UringBlockDevice()
+{
+}
+
+int UringBlockDevice::ReadBatch(BlockIO* requests, uint32_t count)
+{
+	return FileBlockDevice::ReadBatch(requests, count);
+}
+
+#endif
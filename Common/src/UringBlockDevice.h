@@ -0,0 +1,56 @@
+#ifndef URING_BLOCK_DEVICE_H
+#define URING_BLOCK_DEVICE_H
+
+#include "FileBlockDevice.h"
+
+#include <vector>
+
+//FileBlockDevice that submits batched reads through an io_uring, so a whole cluster chain is in flight at once
+//If the ring can't be set up (not Linux, old kernel, or it's forbidden) it behaves exactly like a FileBlockDevice
+class UringBlockDevice : public FileBlockDevice
+{
+public:
+	UringBlockDevice(const std::string& image, uint32_t queueDepth = 64);
+	~UringBlockDevice();
+
+	int ReadBatch(BlockIO* requests, uint32_t count) override;
+
+	bool HasRing() const { return ringFd >= 0; }
+
+private:
+	//Handles the completions posted so far, requests is the current batch, returns how many there were
+	uint32_t Reap(BlockIO* requests, int& ret);
+
+	//Stops using the ring, reads go through FileBlockDevice afterwards
+	void CloseRing();
+
+private:
+	int ringFd = -1;
+
+	uint32_t queueDepth = 0;
+
+	//Ring mappings shared with the kernel
+	void* sqRing = nullptr;
+	void* cqRing = nullptr;
+	void* sqEntries = nullptr;
+	uint64_t sqRingSize = 0;
+	uint64_t cqRingSize = 0;
+	uint64_t sqEntriesSize = 0;
+
+	uint32_t* sqHead = nullptr;
+	uint32_t* sqTail = nullptr;
+	uint32_t* sqMask = nullptr;
+	uint32_t* sqArray = nullptr;
+
+	uint32_t* cqHead = nullptr;
+	uint32_t* cqTail = nullptr;
+	uint32_t* cqMask = nullptr;
+	void* cqEntries = nullptr;
+
+	//One iovec per queue slot, only freed with the device, so a request the kernel still holds never points at freed memory
+	void* vectors = nullptr;
+	//Which requests of the current batch are finished
+	std::vector<uint8_t> done;
+};
+
+#endif
@@ -203,8 +203,6 @@ namespace ext2
 
 		uint32_t parentInode = 0;
 		uint32_t offsetInParentInode = 0;
-
-		ext2_inode inode_data;
 	};
 };
 
@@ -2,18 +2,19 @@
 
 namespace ext2
 {
-	ext2driver::ext2driver(const std::string& image)
+	ext2driver::ext2driver(const std::string& image, BlockDeviceType type)
 	{
-		file.open(image, std::ios::in | std::ios::out | std::ios::binary);
+		device = BlockDevice::Open(image, type);
+		cache = &BufferCache::Shared();
 
-		if (!file.is_open())
+		if (device == nullptr)
 		{
 			std::cerr << "ERROR: " << image << " could not be opened!\n";
+			return;
 		}
 
-		file.seekg(1024);
 		superblock = new SuperBlock();
-		file.read((char*)superblock, 1024);
+		device->Read(1024, superblock, 1024);
 
 		if (superblock->signature != EXT2_SIGNATURE)
 		{
@@ -52,17 +53,61 @@ namespace ext2
 		inode_buffer = new uint8_t[block_size];
 		indirect_buffer = new uint8_t[block_size];
 
-	error:
+		//The descriptor table follows the superblock's block, that's block 2 with 1K blocks and block 1 otherwise
+		group_count = (superblock->total_blocks + blocks_per_block_group - 1) / blocks_per_block_group;
+		groups.resize(group_count);
+		device->Read((uint64_t)(superblock->superblock_block + 1) * block_size, groups.data(), group_count * sizeof(ext2_bgd));
 		return;
+
+	error:
+		//The driver is left closed, IsOpen tells the caller
+		delete superblock;
+		superblock = nullptr;
+		delete device;
+		device = nullptr;
 	}
 
 	ext2driver::~ext2driver()
 	{
+		if (device == nullptr)
+		{
+			return;
+		}
+
+		Sync();
+
 		delete[] inode_buffer;
 		delete[] block_buffer;
 		delete[] indirect_buffer;
 
 		delete superblock;
+		cache->Invalidate(device);
+		delete device;
+	}
+
+	int ext2driver::Sync()
+	{
+		if (device == nullptr)
+		{
+			return -1;
+		}
+
+		int ret = 0;
+
+		//Nothing allocates blocks or inodes yet, so the superblock and the group descriptors never change, only the inodes have to be written
+		inodes.Flush([this](uint64_t number, const ext2_inode& dirty) { StoreInode((uint32_t)number, dirty); });
+
+		if (cache->Sync(device, BlockKind::Metadata) != 0)
+		{
+			ret = -1;
+		}
+
+		if (device->Flush() != 0)
+		{
+			ret = -1;
+		}
+
+		return ret;
 	}
 
 	std::vector<DirEntry> ext2driver::GetDirectories(uint32_t inode)
@@ -73,15 +118,18 @@ namespace ext2
 		return entries;
 	}
 
-	void ext2driver::ModifyDirectoryEntry(uint32_t inode, const char* name, DirEntry modified)
+	void ext2driver::ModifyDirectoryEntry(uint32_t inode, const char* name, const DirEntry& modified)
 	{
+		directoryIndex.Invalidate(inode);
+		dentries.RemoveAt(inode, name);
+
 		ext2_inode ino;
 		ReadInode(inode, &ino);
 
 		uint32_t index = 0;
 		while (true)
 		{
-			uint32_t block = GetBlockOnInode(ino, index++);
+			uint32_t block = GetBlockOnInode(inode, index++);
 			if (block == 0) break;
 			ReadBlock(block, inode_buffer);
 
@@ -101,7 +149,6 @@ namespace ext2
 		}
 
 		WriteInode(inode, ino);
-		WriteInode(modified.inode, modified.inode_data);
 	}
 
 	int ext2driver::PrepareAddedDirectory(uint32_t inode)
@@ -118,7 +165,7 @@ namespace ext2
 		uint32_t index = 0;
 		while(true)
 		{
-			uint32_t block = GetBlockOnInode(ino, index++);
+			uint32_t block = GetBlockOnInode(inode, index++);
 			if (block == 0) break;
 			ReadBlock(block, inode_buffer);
 
@@ -140,10 +187,11 @@ namespace ext2
 		WriteInode(inode, ino);
 	}
 
-	void ext2driver::CleanFileEntry(uint32_t inode, DirEntry entry)
+	void ext2driver::CleanFileEntry(uint32_t inode, const DirEntry& entry)
 	{
-		entry.type_indicator = 0;
-		ModifyDirectoryEntry(inode, entry.name, entry);
+		DirEntry cleaned = entry;
+		cleaned.type_indicator = 0;
+		ModifyDirectoryEntry(inode, entry.name, cleaned);
 	}
 
 	int ext2driver::DirectorySearch(const char* FilePart, uint32_t inode, DirEntry* file)
@@ -153,26 +201,38 @@ namespace ext2
 			return -1;
 		}
 
-		std::vector<DirEntry> entries;
-		GetDirectoriesOnInode(inode, entries);
+		DentryCache<DirEntry>::Result cached = dentries.Lookup(inode, FilePart, file);
+		if (cached != DentryCache<DirEntry>::Result::Unknown)
+		{
+			return (cached == DentryCache<DirEntry>::Result::Found) ? 0 : -2;
+		}
 
-		for (auto entry : entries)
+		//The directory is only decoded the first time, after that every lookup is a hash lookup
+		if (!directoryIndex.IsIndexed(inode))
 		{
-			if (strcmp(entry.name, FilePart) == 0)
-			{
-				if (file != nullptr)
-				{
-					*file = entry;
-				}
+			std::vector<DirEntry> entries;
+			GetDirectoriesOnInode(inode, entries);
+			directoryIndex.Build(inode, entries);
+		}
 
-				return 0;
-			}
+		DirEntry* entry = directoryIndex.Find(inode, FilePart);
+		if (entry == nullptr)
+		{
+			dentries.InsertNegative(inode, FilePart);
+			return -2;
+		}
+
+		dentries.Insert(inode, FilePart, *entry, inode);
+
+		if (file != nullptr)
+		{
+			*file = *entry;
 		}
 
-		return -2;
+		return 0;
 	}
 
-	/*int ext2driver::DirectoryAdd(uint32_t inode, DirEntry file)
+	/*int ext2driver::DirectoryAdd(uint32_t inode, const DirEntry& file)
 	{
 		return 0;
 	}*/
@@ -182,83 +242,109 @@ namespace ext2
 		DirEntry entry;
 		memset(&entry, 0, sizeof(DirEntry));
 
-		ext2_inode ino;
-		ReadInode(inode->inode, &ino);
-
 		strcpy(entry.name, (const char*)inode->name);
 		entry.inode = inode->inode;
-		entry.size = GetSize(ino);
 		entry.type_indicator = inode->type_indicator;
 
-		ReadInode(inode->inode, &entry.inode_data);
+		//Listing the directory again or opening its files finds the inode in the cache
+		entry.size = GetSize(*GetInode(inode->inode));
+		PutInode(inode->inode);
 
 		return entry;
 	}
 
 	void ext2driver::ReadBlock(uint32_t block, void* data)
 	{
-		file.seekg(block * block_size);
-		file.read((char*)data, block_size);
+		cache->Read(device, (uint64_t)block * block_size, data, block_size);
 	}
 
 	void ext2driver::WriteBlock(uint32_t block, void* data)
 	{
-		file.seekg(block * block_size);
-		file.write((char*)data, block_size);
+		cache->Write(device, (uint64_t)block * block_size, data, block_size);
 	}
 
-	void ext2driver::ReadInode(uint32_t inode, ext2_inode* data)
+	uint8_t* ext2driver::GetBlock(uint32_t block, void* buffer)
 	{
-		uint32_t bg = INODE_BG(inode, inodes_per_block_group);
-		ReadBlock(1, block_buffer);
-		ext2_bgd* bgd = (ext2_bgd*)block_buffer;
-		for (uint32_t i = 0; i < bg; i++)
+		uint8_t* mapped = device->Map((uint64_t)block * block_size, block_size);
+		if (mapped)
 		{
-			bgd++;
+			return mapped;
 		}
 
-		uint32_t index = INODE_INDEX(inode, inodes_per_block_group);
-		uint32_t block = INODE_BLOCK(index, inode_size, block_size);
-		ReadBlock(bgd->inode_table + block, block_buffer);
-		ext2_inode* ino = (ext2_inode*)block_buffer;
-		index = index % inodes_per_block;
-		for (uint32_t i = 0; i < index; i++)
+		ReadBlock(block, buffer);
+		return (uint8_t*)buffer;
+	}
+
+	ext2_inode* ext2driver::GetInode(uint32_t inode)
+	{
+		ext2_inode* cached = inodes.Acquire(inode);
+		if (cached)
 		{
-			ino++;
+			return cached;
 		}
 
-		memcpy(data, ino, sizeof(ext2_inode));
+		ext2_inode data;
+		LoadInode(inode, &data);
+		cached = inodes.Insert(inode, data);
+
+		inodes.Trim([this](uint64_t number, const ext2_inode& dirty) { StoreInode((uint32_t)number, dirty); });
+		return cached;
 	}
 
-	void ext2driver::WriteInode(uint32_t inode, ext2_inode data)
+	void ext2driver::PutInode(uint32_t inode)
 	{
-		uint32_t bg = INODE_BG(inode, inodes_per_block_group);
-		ReadBlock(bg, block_buffer);
-		ext2_bgd* bgd = (ext2_bgd*)block_buffer;
+		inodes.Release(inode);
+	}
 
-		while (bg)
+	void ext2driver::ReadInode(uint32_t inode, ext2_inode* data)
+	{
+		memcpy(data, GetInode(inode), sizeof(ext2_inode));
+		PutInode(inode);
+	}
+
+	void ext2driver::WriteInode(uint32_t inode, const ext2_inode& data)
+	{
+		ext2_inode* cached = GetInode(inode);
+
+		//Writing back an inode that was read and not changed costs nothing
+		if (memcmp(cached, &data, sizeof(ext2_inode)) != 0)
 		{
-			bgd++;
-			bg--;
+			memcpy(cached, &data, sizeof(ext2_inode));
+			inodes.MarkDirty(inode);
+
+			//The block pointers may have changed
+			blockMaps.erase(inode);
 		}
 
+		PutInode(inode);
+	}
+
+	void ext2driver::LoadInode(uint32_t inode, ext2_inode* data)
+	{
+		const ext2_bgd& bgd = groups[INODE_BG(inode, inodes_per_block_group)];
+
 		uint32_t index = INODE_INDEX(inode, inodes_per_block_group);
 		uint32_t block = INODE_BLOCK(index, inode_size, block_size);
-		ReadBlock(bgd->inode_bitmap + block, block_buffer);
-		ext2_inode* ino = (ext2_inode*)block_buffer;
-		index = index % inodes_per_block;
+		uint8_t* inode_data = GetBlock(bgd.inode_table + block, block_buffer);
 
-		while (index)
-		{
-			ino++;
-			index--;
-		}
+		//Inodes may be bigger than ext2_inode (inode_size in the superblock), only the start of them is used
+		memcpy(data, inode_data + (index % inodes_per_block) * inode_size, sizeof(ext2_inode));
+	}
+
+	void ext2driver::StoreInode(uint32_t inode, const ext2_inode& data)
+	{
+		const ext2_bgd& bgd = groups[INODE_BG(inode, inodes_per_block_group)];
 
-		memcpy(ino, &data, sizeof(ext2_inode));
-		WriteBlock(bgd->inode_bitmap + block, block_buffer);
+		uint32_t index = INODE_INDEX(inode, inodes_per_block_group);
+		uint32_t block = INODE_BLOCK(index, inode_size, block_size);
+		uint32_t inode_block = bgd.inode_table + block;
+		uint8_t* inode_data = GetBlock(inode_block, block_buffer);
+
+		memcpy(inode_data + (index % inodes_per_block) * inode_size, &data, sizeof(ext2_inode));
+		WriteBlock(inode_block, inode_data);
 	}
 
-	void ext2driver::GetDirectoriesOnInode(uint32_t inode, std::vector<DirEntry>& entries)
+	void ext2driver::ForEachEntry(uint32_t inode, const std::function<bool(const DirEntry&)>& callback)
 	{
 		ext2_inode ino;
 		ReadInode(inode, &ino);
@@ -273,11 +359,9 @@ namespace ext2
 		uint32_t index = 0;
 		while (true)
 		{
-			uint32_t block = GetBlockOnInode(ino, index++);
+			uint32_t block = GetBlockOnInode(inode, index++);
 			if (block == 0) break;
-			ReadBlock(block, inode_buffer);
-
-			directory_entry* entry = (directory_entry*)inode_buffer;
+			directory_entry* entry = (directory_entry*)GetBlock(block, inode_buffer);
 			uint32_t totalSize = 0;
 			while (totalSize < block_size)
 			{
@@ -289,7 +373,10 @@ namespace ext2
 				DirEntry _entry = ToDirEntry(entry);
 				_entry.parentInode = inode;
 				_entry.offsetInParentInode = offset;
-				entries.push_back(_entry);
+				if (!callback(_entry))
+				{
+					return;
+				}
 
 				totalSize += entry->size;
 				entry = (directory_entry*)((uint64_t)entry + entry->size);
@@ -298,6 +385,15 @@ namespace ext2
 		}
 	}
 
+	void ext2driver::GetDirectoriesOnInode(uint32_t inode, std::vector<DirEntry>& entries)
+	{
+		ForEachEntry(inode, [&](const DirEntry& entry)
+		{
+			entries.push_back(entry);
+			return true;
+		});
+	}
+
 	uint32_t ext2driver::GetInodeFromFilePath(const char* filePath, DirEntry* entry)
 	{
 		char fileNamePart[256];
@@ -312,7 +408,6 @@ namespace ext2
 			fileInfo.inode = active_inode;
 			fileInfo.size = 0;
 			fileInfo.type_indicator = EXT2_TYPE_DIR;
-			ReadInode(2, &fileInfo.inode_data);
 		}
 		else
 		{
@@ -349,46 +444,107 @@ namespace ext2
 		return active_inode;
 	}
 
-	uint32_t ext2driver::GetBlockOnInode(ext2_inode inode, uint64_t block_index)
+	uint32_t ext2driver::GetBlockOnInode(uint32_t inode, uint64_t block_index)
+	{
+		auto it = blockMaps.find(inode);
+		if (it == blockMaps.end())
+		{
+			if (blockMaps.size() >= MaxBlockMaps)
+			{
+				blockMaps.clear();
+			}
+
+			it = blockMaps.insert({ inode, ExtentMap() }).first;
+		}
+
+		ExtentMap& map = it->second;
+		if (block_index >= map.GetLength())
+		{
+			ExtendBlockMap(inode, map, block_index);
+		}
+
+		return (uint32_t)map.Lookup(block_index);
+	}
+
+	void ext2driver::ExtendBlockMap(uint32_t inode, ExtentMap& map, uint64_t block_index)
 	{
-		uint32_t pointers_per_block = block_size / 4;
+		const ext2_inode* ino = GetInode(inode);
 
-		if (block_index < 12)
+		uint64_t pointers_per_block = block_size / 4;
+		uint64_t blocks = (GetSize(*ino) + block_size - 1) / block_size;
+
+		//The map is extended to the end of the indirect block block_index is in, so every indirect block is read once
+		uint64_t first = map.GetLength();
+		uint64_t last = (block_index < 12) ? 12 : (12 + ((block_index - 12) / pointers_per_block + 1) * pointers_per_block);
+		if (last > blocks)
 		{
-			return inode.direct[block_index];
+			last = blocks;
 		}
-		else if(block_index < (12 + pointers_per_block))
+
+		//The direct blocks, then the trees under the single, double and triple indirect blocks
+		const uint32_t tables[] = { ino->single_indirect, ino->double_indirect, ino->triple_indirect };
+		uint64_t base = 12;
+		uint64_t span = pointers_per_block;
+
+		for (uint64_t index = first; index < last && index < 12; index++)
 		{
-			uint32_t indirect_index = block_index - 12;
-			ReadBlock(inode.single_indirect, indirect_buffer);
-			return ((uint32_t*)indirect_buffer)[indirect_index];
+			map.Append(ino->direct[index]);
+		}
+
+		for (uint32_t level = 0; level < 3 && base < last; level++)
+		{
+			if (map.GetLength() < base + span)
+			{
+				uint64_t end = (last < base + span) ? last : (base + span);
+				MapIndirect(map, tables[level], level, map.GetLength() - base, end - base);
+			}
+
+			base += span;
+			span *= pointers_per_block;
 		}
-		else if (block_index < (12 + pointers_per_block + pointers_per_block * pointers_per_block))
+
+		PutInode(inode);
+	}
+
+	void ext2driver::MapIndirect(ExtentMap& map, uint32_t table, uint32_t level, uint64_t first, uint64_t end)
+	{
+		if (table == 0)
 		{
-			uint32_t indirect_index = block_index - 12 - pointers_per_block;
-			ReadBlock(inode.double_indirect, indirect_buffer);
-			uint32_t single_indirect = ((uint32_t*)indirect_buffer)[indirect_index];
+			//Nothing is allocated under it
+			for (uint64_t index = first; index < end; index++)
+			{
+				map.Append(0);
+			}
 
-			indirect_index = block_index - 12;
-			ReadBlock(single_indirect, indirect_buffer);
-			return ((uint32_t*)indirect_buffer)[indirect_index];
+			return;
 		}
-		else if (block_index < (12 + pointers_per_block + pointers_per_block * pointers_per_block + pointers_per_block * pointers_per_block * pointers_per_block))
+
+		uint64_t pointers_per_block = block_size / 4;
+		uint32_t* pointers = (uint32_t*)GetBlock(table, indirect_buffer);
+		if (level == 0)
 		{
-			uint32_t indirect_index = block_index - 12 - pointers_per_block - pointers_per_block * pointers_per_block;
-			ReadBlock(inode.triple_indirect, indirect_buffer);
-			uint32_t double_indirect = ((uint32_t*)indirect_buffer)[indirect_index];
+			for (uint64_t index = first; index < end; index++)
+			{
+				map.Append(pointers[index]);
+			}
 
-			indirect_index = block_index - 12 - pointers_per_block;
-			ReadBlock(double_indirect, indirect_buffer);
-			uint32_t single_indirect = ((uint32_t*)indirect_buffer)[indirect_index];
+			return;
+		}
 
-			indirect_index = block_index - 12;
-			ReadBlock(single_indirect, indirect_buffer);
-			return ((uint32_t*)indirect_buffer)[indirect_index];
+		//Each pointer covers span blocks, the ones needed are copied out as the recursion reuses indirect_buffer
+		uint64_t span = 1;
+		for (uint32_t i = 0; i < level; i++)
+		{
+			span *= pointers_per_block;
 		}
 
-		return 0;
+		std::vector<uint32_t> children(pointers + first / span, pointers + (end - 1) / span + 1);
+		for (uint64_t child = first / span; child <= (end - 1) / span; child++)
+		{
+			uint64_t childFirst = (first > child * span) ? (first - child * span) : 0;
+			uint64_t childEnd = (end < (child + 1) * span) ? (end - child * span) : span;
+			MapIndirect(map, children[child - first / span], level - 1, childFirst, childEnd);
+		}
 	}
 
 	uint64_t ext2driver::GetSize(ext2_inode inode)
@@ -403,6 +559,54 @@ namespace ext2
 		}
 	}
 
+	void ext2driver::ReadAhead(const DirEntry& fileMeta, uint64_t offset, uint64_t bytes)
+	{
+		uint64_t start = 0;
+		uint64_t length = 0;
+		if (!readahead.Access(fileMeta.inode, offset, bytes, start, length) || start >= fileMeta.size)
+		{
+			return;
+		}
+
+		uint64_t end = start + length;
+		if (end > fileMeta.size)
+		{
+			end = fileMeta.size;
+		}
+
+		//Blocks that follow each other on the disk are hinted together, holes have nothing to prefetch
+		uint64_t runStart = 0;
+		uint64_t runLength = 0;
+		for (uint64_t index = start / block_size; index <= (end - 1) / block_size; index++)
+		{
+			uint32_t block = GetBlockOnInode(fileMeta.inode, index);
+			if (block == 0)
+			{
+				continue;
+			}
+
+			uint64_t physical = (uint64_t)block * block_size;
+			if (runLength && (runStart + runLength) == physical)
+			{
+				runLength += block_size;
+				continue;
+			}
+
+			if (runLength)
+			{
+				device->Prefetch(runStart, runLength);
+			}
+
+			runStart = physical;
+			runLength = block_size;
+		}
+
+		if (runLength)
+		{
+			device->Prefetch(runStart, runLength);
+		}
+	}
+
 	int ext2driver::OpenFile(const char* filePath, DirEntry* fileMeta)
 	{
 		if (fileMeta == nullptr)
@@ -419,50 +623,85 @@ namespace ext2
 		return 0;
 	}
 
-	int ext2driver::ReadFile(DirEntry fileMeta, uint64_t offset, void* buffer, uint64_t bytes)
+	int ext2driver::ReadFile(const DirEntry& fileMeta, uint64_t offset, void* buffer, uint64_t bytes)
 	{
 		if ((fileMeta.type_indicator & 0xF000) == EXT2_TYPE_DIR)
 		{
 			return -3;
 		}
 
+		if (offset >= fileMeta.size)
+		{
+			return 0;
+		}
+
 		if ((bytes + offset) > fileMeta.size)
 		{
 			bytes = fileMeta.size - offset;
 		}
 
-		uint64_t bytes_so_far = 0;
+		if (bytes == 0)
+		{
+			return 0;
+		}
+
+		//The window after this read is requested first, the device loads it while this read is served and consumed
+		ReadAhead(fileMeta, offset, bytes);
+
+		//Only the blocks covering [offset, offset + bytes) are mapped, starting directly at the first one
+		uint64_t end = offset + bytes;
+		uint64_t first = offset / block_size;
+		uint64_t last = (end - 1) / block_size;
+
+		std::vector<BlockIO>& requests = readRequests;
+		requests.clear();
+
 		uint8_t* buff = (uint8_t*)buffer;
-		uint32_t index = 0;
-		while (true)
+		for (uint64_t index = first; index <= last; index++)
 		{
-			uint32_t block = GetBlockOnInode(fileMeta.inode_data, index++);
-			if (block == 0) break;
+			uint64_t blockStart = index * block_size;
+			uint64_t from = (offset > blockStart) ? (offset - blockStart) : 0;
+			uint64_t to = (end < blockStart + block_size) ? (end - blockStart) : block_size;
 
-			if (bytes_so_far < offset)
+			uint32_t block = GetBlockOnInode(fileMeta.inode, index);
+			if (block == 0)
 			{
-				bytes_so_far += block_size;
-				continue;
+				//Sparse files have holes, they read back as zeros
+				memset(buff, 0, to - from);
 			}
-
-			uint64_t toRead = (bytes + offset) - bytes_so_far;
-			if (toRead > block_size)
+			else if (from != 0)
 			{
-				toRead = block_size;
-				ReadBlock(block, buff);
+				//Only the first block can start in the middle, the part before the offset is skipped and the rest is read in place
+				IOSegment head[] = { { nullptr, from }, { buff, to - from } };
+				if (cache->ReadVector(device, (uint64_t)block * block_size, head, 2, block_size) != 0)
+				{
+					return -1;
+				}
 			}
 			else
 			{
-				uint8_t* temporary = new uint8_t[block_size];
-				ReadBlock(block, temporary);
-				memcpy(buff, temporary, toRead);
-				delete[] temporary;
+				//Blocks that follow each other both on the disk and in the buffer are merged into a single request
+				uint64_t physical = (uint64_t)block * block_size;
+				BlockIO* previous = (requests.size() > 0) ? &requests.back() : nullptr;
+				if (previous && (previous->offset + previous->size) == physical && ((uint8_t*)previous->buffer + previous->size) == buff
+					&& (previous->size % block_size) == 0 && (previous->size + to) <= cache->GetMaxTransfer())
+				{
+					previous->size += to;
+				}
+				else
+				{
+					requests.push_back({ physical, buff, to });
+				}
 			}
 
-			buff += block_size;
-			bytes_so_far += toRead;
+			buff += to - from;
 		}
 
-		return 0;
+		if (requests.size() == 0)
+		{
+			return 0;
+		}
+
+		return cache->ReadBatch(device, requests.data(), (uint32_t)requests.size(), block_size);
 	}
 };
@@ -2,11 +2,20 @@
 #define EXT2_H
 
 #include "ext2defs.h"
+#include "BlockDevice.h"
+#include "BufferCache.h"
+#include "Readahead.h"
+#include "DirectoryIndex.h"
+#include "DentryCache.h"
+#include "InodeCache.h"
+#include "ExtentMap.h"
 
 #define INODE_BG(in, in_per_g) ((in - 1) / in_per_g)
 #define INODE_INDEX(in, in_per_g) ((in - 1) % in_per_g)
 #define INODE_BLOCK(in_in_bg, in_size, block_size) ((in_in_bg * in_size) / block_size)
 
+#include <functional>
+#include <unordered_map>
 #include <vector>
 
 namespace ext2
@@ -14,26 +23,36 @@ namespace ext2
 	class ext2driver
 	{
 	public:
-		ext2driver(const std::string& image);
+		ext2driver(const std::string& image, BlockDeviceType type = BlockDeviceType::File);
 		~ext2driver();
 
+		//False if the image couldn't be opened or isn't a mountable ext2 filesystem, nothing else may be called then
+		bool IsOpen() const { return device != nullptr; }
+
 		std::vector<DirEntry> GetDirectories(uint32_t inode);
 
-		void ModifyDirectoryEntry(uint32_t inode, const char* name, DirEntry modified);
+		//Calls callback with every entry of the directory, in order, decoding them one at a time
+		//Returning false from callback stops the walk, the callback mustn't modify the directory
+		void ForEachEntry(uint32_t inode, const std::function<bool(const DirEntry&)>& callback);
+
+		void ModifyDirectoryEntry(uint32_t inode, const char* name, const DirEntry& modified);
 
 		int PrepareAddedDirectory(uint32_t inode);
-		void CleanFileEntry(uint32_t inode, DirEntry entry);
+		void CleanFileEntry(uint32_t inode, const DirEntry& entry);
 
 		int DirectorySearch(const char* FilePart, uint32_t inode, DirEntry* file);
-		int DirectoryAdd(uint32_t inode, DirEntry file);
+		int DirectoryAdd(uint32_t inode, const DirEntry& file);
 
 		int OpenFile(const char* filePath, DirEntry* fileMeta);
 		int CreateFile(const char* filePath, DirEntry* fileMeta);
-		int DeleteFile(DirEntry fileMeta);
+		int DeleteFile(const DirEntry& fileMeta);
 
-		int ReadFile(DirEntry fileMeta, uint64_t offset, void* buffer, uint64_t bytes);
-		int WriteFile(DirEntry fileMeta, uint64_t offset, void* buffer, uint64_t bytes);
-		int ResizeFile(DirEntry fileMeta, uint32_t new_size);
+		int ReadFile(const DirEntry& fileMeta, uint64_t offset, void* buffer, uint64_t bytes);
+		int WriteFile(const DirEntry& fileMeta, uint64_t offset, void* buffer, uint64_t bytes);
+		int ResizeFile(const DirEntry& fileMeta, uint32_t new_size);
+
+		//Writes the modified inodes back, then flushes the device
+		int Sync();
 
 	private:
 		DirEntry ToDirEntry(directory_entry* inode);
@@ -41,23 +60,70 @@ namespace ext2
 		void ReadBlock(uint32_t block, void* data);
 		void WriteBlock(uint32_t block, void* data);
 
+		//Returns the block's data, pointing straight into the image if it's memory mapped, otherwise it's read into buffer
+		uint8_t* GetBlock(uint32_t block, void* buffer);
+
+		//Returns the cached inode (read from the disk on a miss), it stays valid until PutInode
+		ext2_inode* GetInode(uint32_t inode);
+		void PutInode(uint32_t inode);
+
+		//Copy out of and into the inode cache, a written inode reaches the disk on Sync or when it's dropped from the cache
 		void ReadInode(uint32_t inode, ext2_inode* data);
-		void WriteInode(uint32_t inode, ext2_inode data);
+		void WriteInode(uint32_t inode, const ext2_inode& data);
+
+		//The inode table itself
+		void LoadInode(uint32_t inode, ext2_inode* data);
+		void StoreInode(uint32_t inode, const ext2_inode& data);
 
 		void GetDirectoriesOnInode(uint32_t inode, std::vector<DirEntry>& entries);
 		uint32_t GetInodeFromFilePath(const char* filePath, DirEntry* entry);
 
-		uint32_t GetBlockOnInode(ext2_inode inode, uint64_t block_index);
+		//Returns the block_index-th block of the inode, 0 for a hole or past the end of the file
+		//The blocks are looked up in the inode's block map, which is extended from the (indirect) block pointers when needed
+		uint32_t GetBlockOnInode(uint32_t inode, uint64_t block_index);
+
+		//Maps the blocks after the ones in map up to the end of the indirect block block_index is in
+		void ExtendBlockMap(uint32_t inode, ExtentMap& map, uint64_t block_index);
+
+		//Appends the blocks [first, end) of the tree under table, level is 0 for a single indirect block, 1 for a double and 2 for a triple one
+		void MapIndirect(ExtentMap& map, uint32_t table, uint32_t level, uint64_t first, uint64_t end);
 
 		uint64_t GetSize(ext2_inode inode);
 
+		//Prefetches the blocks ahead of a read of the file, if its reads have been sequential so far
+		void ReadAhead(const DirEntry& fileMeta, uint64_t offset, uint64_t bytes);
+
 	private:
-		std::fstream file;
+		BlockDevice* device = nullptr;
+		BufferCache* cache;
+
+		SuperBlock* superblock = nullptr;
+
+		//The whole block group descriptor table, read at mount
+		std::vector<ext2_bgd> groups;
+		uint32_t group_count;
+		uint8_t* block_buffer = nullptr;
+		uint8_t* inode_buffer = nullptr;
+		uint8_t* indirect_buffer = nullptr;
+
+		//Sequential read detection, keyed by inode
+		Readahead readahead;
+
+		//The device requests of a ReadFile, kept so it only allocates while the reads keep getting bigger
+		std::vector<BlockIO> readRequests;
+
+		//Entries of the directories searched, keyed by the directories' inode
+		DirectoryIndex<DirEntry> directoryIndex;
+
+		//Inodes read lately and the ones modified since the last Sync
+		InodeCache<ext2_inode> inodes;
+
+		//Logical to physical block maps of the inodes read, built as far as they were accessed
+		std::unordered_map<uint32_t, ExtentMap> blockMaps;
+		static const uint32_t MaxBlockMaps = 256;
 
-		SuperBlock* superblock;
-		uint8_t* block_buffer;
-		uint8_t* inode_buffer;
-		uint8_t* indirect_buffer;
+		//Path components resolved lately (and the ones that weren't found), keyed by the directory's inode
+		DentryCache<DirEntry> dentries;
 
 		uint32_t blocks_per_block_group;
 		uint32_t inodes_per_block_group;
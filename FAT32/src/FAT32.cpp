@@ -1,77 +1,58 @@
 #include "FAT32.h"
 
-FAT32::FAT32(const std::string& file)
+DirEntry FAT32_NodeEntry::ToDirEntry() const
 {
-	driver = new FAT32Driver(file);
+	DirEntry entry;
+	strcpy(entry.name, name);
+	entry.cluster = cluster;
+	entry.size = size;
+	entry.attributes = attributes;
+	entry.parentCluster = parentCluster;
+	entry.offsetInParentCluster = offsetInParentCluster;
+	return entry;
+}
+
+FAT32::FAT32(const std::string& file, BlockDeviceType type, bool prefetchTree)
+{
+	driver = new FAT32Driver(file, type);
 	uint32_t rootDirStart = driver->GetRootDirStart();
 
-	root = new FAT32_FolderStructure();
-	root->parent = nullptr;
-	strcpy(root->entry.name, "~");
-	root->entry.size = 0;
-	root->entry.attributes = 0;
-	root->entry.cluster = rootDirStart;
+	DirEntry rootEntry;
+	strcpy(rootEntry.name, "~");
+	rootEntry.size = 0;
+	rootEntry.attributes = FILE_DIRECTORY;
+	rootEntry.cluster = rootDirStart;
 
-	current = root;
+	root = NewNode(nullptr, rootEntry);
 
-	std::vector<uint32_t> clustersToRead = { rootDirStart };
-	std::vector<uint32_t> nextClustersToRead;
+	current = root;
+	Register(root, "~");
 
-	while (clustersToRead.size() != 0)
+	if (prefetchTree)
 	{
-		for (auto clus : clustersToRead)
-		{
-			//Ain't no need for the volume's identifier (a FILE_VOLUME_ID entry on root)
-			std::vector<DirEntry> rootDir = driver->GetDirectories(clus, FILE_VOLUME_ID, false);
-
-			for (size_t i = 0; i < rootDir.size(); i++)
-			{
-				DirEntry parent = rootDir[0];
-				DirEntry entry = rootDir[i];
-
-				if (((entry.attributes & FILE_DIRECTORY) == FILE_DIRECTORY) && (entry.name[0] != '.'))
-				{
-					nextClustersToRead.push_back(entry.cluster);
-				}
-
-				FAT32_FolderStructure* curr = new FAT32_FolderStructure();
-				FAT32_FolderStructure* par_dir = GetFolderByCluster(parent.cluster);
-
-				//If we don't have '.' and '..' entries, we're in the root directory
-				if (parent.name[0] != '.')
-				{
-					curr->parent = root;
-					curr->entry = entry;
-
-					root->children.push_back(curr);
-				}
-				else
-				{
-					curr->parent = par_dir;
-					curr->entry = entry;
-
-					par_dir->children.push_back(curr);
-				}
-			}
-		}
-
-		clustersToRead = nextClustersToRead;
-		nextClustersToRead.clear();
+		prefetchThread = std::thread(&FAT32::PrefetchTree, this);
 	}
 }
 
 FAT32::~FAT32()
 {
-	delete root;
+	stopPrefetch = true;
+	if (prefetchThread.joinable())
+	{
+		prefetchThread.join();
+	}
+
+	//The whole tree goes at once
+	nodes.Clear();
 	delete driver;
 }
 
 FAT32_OpenFile* FAT32::OpenFile(const std::string& path)
 {
-	DirEntry entry;
-	int ret = driver->OpenFile(path.c_str(), &entry);
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
 
-	if (ret != 0)
+	FAT32_FolderStructure* node = LoadPath(path);
+	if (node == nullptr)
 	{
 		return nullptr;
 	}
@@ -81,21 +62,16 @@ FAT32_OpenFile* FAT32::OpenFile(const std::string& path)
 	strcpy(ptr, full.c_str());
 
 	FAT32_OpenFile* file = new FAT32_OpenFile();
-	file->file = RetrieveFromRoot(entry);
+	file->file = node;
 	file->path = ptr;
 
-	if (file->file == nullptr)
-	{
-		delete[] file->path;
-		delete file;
-		return nullptr;
-	}
-
 	return file;
 }
 
 FAT32_OpenFile* FAT32::CreateFile(const std::string& path, const std::string& fileName, uint8_t attributes, uint64_t size)
 {
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
+
 	DirEntry entry;
 	strcpy(entry.name, fileName.c_str());
 	entry.cluster = 0;
@@ -110,7 +86,7 @@ FAT32_OpenFile* FAT32::CreateFile(const std::string& path, const std::string& fi
 	strcpy(ptr, full.c_str());
 
 	FAT32_OpenFile* file = new FAT32_OpenFile();
-	file->file = RetrieveFromRoot(entry);
+	file->file = LoadPath(full);
 	file->path = ptr;
 
 	return file;
@@ -118,7 +94,9 @@ FAT32_OpenFile* FAT32::CreateFile(const std::string& path, const std::string& fi
 
 void FAT32::DeleteFile(FAT32_OpenFile* file)
 {
-	driver->DeleteFile(file->file->entry);
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
+
+	driver->DeleteFile(file->file->entry.ToDirEntry());
 
 	DeleteFromRecords(file->path);
 	CloseFile(file);
@@ -132,8 +110,10 @@ void FAT32::CloseFile(FAT32_OpenFile* file)
 
 int FAT32::ReadFile(FAT32_OpenFile* file, void* buffer, uint64_t nBytes)
 {
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
+
 	uint64_t seek_pos = file->SeekPosition;
-	driver->ReadFile(file->file->entry, seek_pos, buffer, nBytes);
+	driver->ReadFile(file->file->entry.ToDirEntry(), seek_pos, buffer, nBytes);
 	file->SeekPosition += nBytes;
 
 	return 0;
@@ -141,8 +121,10 @@ int FAT32::ReadFile(FAT32_OpenFile* file, void* buffer, uint64_t nBytes)
 
 int FAT32::WriteFile(FAT32_OpenFile* file, void* buffer, uint64_t nBytes)
 {
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
+
 	uint64_t seek_pos = file->SeekPosition;
-	driver->WriteFile(file->file->entry, seek_pos, buffer, nBytes);
+	driver->WriteFile(file->file->entry.ToDirEntry(), seek_pos, buffer, nBytes);
 	file->SeekPosition += nBytes;
 
 	if (file->file->entry.size < file->SeekPosition)
@@ -155,113 +137,90 @@ int FAT32::WriteFile(FAT32_OpenFile* file, void* buffer, uint64_t nBytes)
 
 int FAT32::ResizeFile(FAT32_OpenFile* file, uint64_t new_size)
 {
-	driver->ResizeFile(file->file->entry, new_size);
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
+
+	driver->ResizeFile(file->file->entry.ToDirEntry(), new_size);
 	file->file->entry.size = new_size;
 	file->SeekPosition = 0;
 
 	return 0;
 }
 
-void FAT32::AddToRecords(const std::string& path, DirEntry entry)
+void FAT32::AddToRecords(const std::string& path, const DirEntry& entry)
 {
-	FAT32_FolderStructure* parent = root;
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
 
-	if (path != "~")
+	//If the directory wasn't loaded yet, the entry is read along with the others when it is
+	FAT32_FolderStructure* parent = LoadPath(path);
+	if (parent == nullptr || !parent->loaded)
 	{
-		uint32_t last = 2;
-		for (uint32_t i = 2; i < path.length(); i++)
-		{
-			if (path[i] == '/' || (i == (path.length() - 1)))
-			{
-				size_t size = i - last;
-				if (i == (path.length() - 1))
-				{
-					size++;
-				}
-
-				std::string subdir = path.substr(last, size);
-				last = i + 1;
-
-				for (auto child : parent->children)
-				{
-					if (subdir == child->entry.name)
-					{
-						parent = child;
-						break;
-					}
-				}
-			}
-		}
+		return;
 	}
 
-	FAT32_FolderStructure* curr = new FAT32_FolderStructure();
+	FAT32_FolderStructure* curr = NewNode(parent, entry);
+	curr->loaded = ((entry.attributes & FILE_DIRECTORY) != FILE_DIRECTORY);
 
-	curr->parent = parent;
-	curr->entry = entry;
-
-	parent->children.push_back(curr);
+	Register(curr, GetPath(curr));
 }
 
 void FAT32::DeleteFromRecords(const std::string& name)
 {
-	FAT32_FolderStructure* curr = root;
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
 
-	uint32_t last = 2;
-	for (uint32_t i = 2; i < name.length(); i++)
+	//If its directory wasn't loaded yet, the entry is already gone from the disk, it won't be found
+	FAT32_FolderStructure* curr = LoadPath(name);
+	if (curr == nullptr || curr->parent == nullptr)
 	{
-		if (name[i] == '/' || (i == (name.length() - 1)))
-		{
-			size_t size = i - last;
-			if (i == (name.length() - 1))
-			{
-				size++;
-			}
-
-			std::string subdir = name.substr(last, size);
-			last = i + 1;
+		return;
+	}
 
-			for (size_t i = 0; i < curr->children.size(); i++)
-			{
-				auto child = curr->children[i];
-				if (subdir == child->entry.name)
-				{
-					curr = child;
-					break;
-				}
-			}
+	//current may be anywhere under it
+	for (FAT32_FolderStructure* dir = current; dir; dir = dir->parent)
+	{
+		if (dir == curr)
+		{
+			current = curr->parent;
+			break;
 		}
 	}
 
-	auto idx = std::find(curr->parent->children.begin(), curr->parent->children.end(), curr);
-	curr->parent->children.erase(idx);
-	delete curr;
+	Unregister(curr, GetPath(curr));
+
+	RemoveChild(curr->parent, curr->index);
+	FreeNode(curr);
 }
 
 std::string FAT32::GetCurrentDirectory() const
 {
-	std::string name = "~";
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
 
-	std::vector<FAT32_FolderStructure*> structs;
-	FAT32_FolderStructure* curr = current;
-	while (curr->parent)
-	{
-		structs.push_back(curr);
-		curr = curr->parent;
-	}
+	return GetPath(current);
+}
 
-	for (auto it = structs.rbegin(); it != structs.rend(); ++it)
-	{
-		name += '/';
-		name += (*it)->entry.name;
-	}
-	
-	return name;
+FAT32_FolderStructure* FAT32::GetFolderByCluster(uint32_t cluster)
+{
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
+
+	auto it = nodesByCluster.find(cluster);
+	return (it != nodesByCluster.end()) ? it->second : nullptr;
+}
+
+FAT32_FolderStructure* FAT32::GetChild(const FAT32_FolderStructure* dir, uint32_t index) const
+{
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
+
+	return nodes.Get(childIndices[dir->childStart + index]);
 }
 
 void FAT32::ListCurrent()
 {
-	for (auto elem : current->children)
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
+
+	LoadChildren(current);
+	for (uint32_t i = 0; i < current->childCount; i++)
 	{
+		FAT32_FolderStructure* elem = GetChild(current, i);
+
 		//No need to display the parent and self directory
 		if (elem->entry.name[0] == '.')
 		{
@@ -281,6 +240,8 @@ void FAT32::ListCurrent()
 
 void FAT32::GoTo(char* name)
 {
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
+
 	size_t len = strlen(name);
 	if ((memcmp(name, ".", 1) == 0) && (len == 1))
 	{
@@ -296,8 +257,10 @@ void FAT32::GoTo(char* name)
 		return;
 	}
 
-	for (auto elem : current->children)
+	LoadChildren(current);
+	for (uint32_t i = 0; i < current->childCount; i++)
 	{
+		FAT32_FolderStructure* elem = GetChild(current, i);
 		if (strcmp(elem->entry.name, name) == 0)
 		{
 			if ((elem->entry.attributes & FILE_DIRECTORY) & FILE_DIRECTORY)
@@ -310,51 +273,286 @@ void FAT32::GoTo(char* name)
 	}
 }
 
-FAT32_FolderStructure* FAT32::RetrieveFromRoot(DirEntry entry)
+void FAT32::LoadChildren(FAT32_FolderStructure* dir)
+{
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
+
+	if (dir->loaded)
+	{
+		return;
+	}
+
+	dir->loaded = true;
+	if ((dir->entry.attributes & FILE_DIRECTORY) != FILE_DIRECTORY)
+	{
+		return;
+	}
+
+	std::string base = GetPath(dir) + '/';
+
+	//Ain't no need for the volume's identifier (a FILE_VOLUME_ID entry on root)
+	driver->ForEachEntry(dir->entry.cluster, [&](const DirEntry& entry)
+	{
+		if (entry.attributes & FILE_VOLUME_ID)
+		{
+			return true;
+		}
+
+		FAT32_FolderStructure* curr = NewNode(dir, entry);
+
+		//The '.' and '..' entries point at directories that have nodes of their own
+		curr->loaded = ((entry.attributes & FILE_DIRECTORY) != FILE_DIRECTORY) || (entry.name[0] == '.');
+
+		Register(curr, base + entry.name);
+		return true;
+	});
+}
+
+FAT32_FolderStructure* FAT32::LoadPath(const std::string& path)
 {
-	std::vector<FAT32_FolderStructure*> all = GetAllEntries(root);
-	for (auto elem : all)
+	std::lock_guard<std::recursive_mutex> guard(treeLock);
+
+	auto known = nodesByPath.find(path);
+	if (known != nodesByPath.end())
 	{
-		if (elem->entry.cluster == entry.cluster)
+		return known->second;
+	}
+
+	//Not loaded yet (or not written the way the index has it), it's walked one directory at a time
+	FAT32_FolderStructure* curr = root;
+	std::string currPath = "~";
+
+	size_t start = 2; //Skip the "~/" part
+	while (start < path.length())
+	{
+		size_t end = path.find('/', start);
+		if (end == std::string::npos)
+		{
+			end = path.length();
+		}
+
+		//A '/' at the end (or two in a row) doesn't name anything
+		if (end != start)
 		{
-			return elem;
+			LoadChildren(curr);
+
+			currPath += '/';
+			currPath.append(path, start, end - start);
+
+			auto next = nodesByPath.find(currPath);
+			if (next == nodesByPath.end())
+			{
+				return nullptr;
+			}
+
+			curr = next->second;
 		}
+
+		start = end + 1;
 	}
 
-	return nullptr;
+	return curr;
 }
 
-FAT32_FolderStructure* FAT32::GetFolderByCluster(uint32_t cluster)
+FAT32_FolderStructure* FAT32::NewNode(FAT32_FolderStructure* parent, const DirEntry& entry)
 {
-	if (root->entry.cluster == cluster)
+	uint32_t index = nodes.Allocate();
+
+	FAT32_FolderStructure* node = nodes.Get(index);
+	node->parent = parent;
+	node->entry.name = names.Intern(entry.name);
+	node->entry.cluster = entry.cluster;
+	node->entry.size = entry.size;
+	node->entry.attributes = entry.attributes;
+	node->entry.parentCluster = entry.parentCluster;
+	node->entry.offsetInParentCluster = entry.offsetInParentCluster;
+	node->index = index;
+
+	if (parent)
 	{
-		return root;
+		AddChild(parent, index);
 	}
 
-	std::vector<FAT32_FolderStructure*> all = GetAllEntries(root);
-	for (auto elem : all)
+	return node;
+}
+
+void FAT32::FreeNode(FAT32_FolderStructure* node)
+{
+	for (uint32_t i = 0; i < node->childCount; i++)
 	{
-		if (elem->entry.cluster == cluster)
+		FreeNode(GetChild(node, i));
+	}
+
+	FreeRange(node->childStart, node->childCapacity);
+	nodes.Free(node->index);
+}
+
+void FAT32::AddChild(FAT32_FolderStructure* dir, uint32_t child)
+{
+	if (dir->childCount == dir->childCapacity)
+	{
+		uint32_t end = (uint32_t)childIndices.size();
+		uint32_t grow = (dir->childCount < 4) ? 4 : dir->childCount;
+
+		//At the end of the pool the range just grows, anywhere else it's moved to a free range (or the end) first
+		if (dir->childStart + dir->childCapacity != end)
+		{
+			uint32_t start = AllocRange(dir->childCount + grow);
+			memcpy(&childIndices[start], &childIndices[dir->childStart], dir->childCount * sizeof(uint32_t));
+			FreeRange(dir->childStart, dir->childCapacity);
+			dir->childStart = start;
+		}
+		else
 		{
-			return elem;
+			childIndices.resize(end + grow);
 		}
+
+		dir->childCapacity = dir->childCount + grow;
 	}
 
-	return nullptr;
+	childIndices[dir->childStart + dir->childCount] = child;
+	dir->childCount++;
 }
 
-std::vector<FAT32_FolderStructure*> FAT32::GetAllEntries(FAT32_FolderStructure* top)
+void FAT32::RemoveChild(FAT32_FolderStructure* dir, uint32_t child)
 {
-	std::vector<FAT32_FolderStructure*> res = top->children;
+	uint32_t* children = &childIndices[dir->childStart];
+	for (uint32_t i = 0; i < dir->childCount; i++)
+	{
+		if (children[i] == child)
+		{
+			memmove(&children[i], &children[i + 1], (dir->childCount - i - 1) * sizeof(uint32_t));
+			dir->childCount--;
+			return;
+		}
+	}
+}
 
-	for (auto elem : top->children)
+uint32_t FAT32::AllocRange(uint32_t capacity)
+{
+	//The smallest free range that fits, what's left of it stays free
+	auto it = freeRanges.lower_bound(capacity);
+	if (it != freeRanges.end())
 	{
-		std::vector<FAT32_FolderStructure*> ret = GetAllEntries(elem);
-		for (auto el : ret)
+		uint32_t start = it->second;
+		uint32_t left = it->first - capacity;
+		freeRanges.erase(it);
+
+		if (left > 0)
 		{
-			res.push_back(el);
+			freeRanges.emplace(left, start + capacity);
 		}
+
+		return start;
 	}
 
-	return res;
+	uint32_t start = (uint32_t)childIndices.size();
+	childIndices.resize(start + capacity);
+	return start;
+}
+
+void FAT32::FreeRange(uint32_t start, uint32_t capacity)
+{
+	if (capacity == 0)
+	{
+		return;
+	}
+
+	//A range at the end of the pool is simply cut off
+	if (start + capacity == childIndices.size())
+	{
+		childIndices.resize(start);
+		return;
+	}
+
+	freeRanges.emplace(capacity, start);
+}
+
+void FAT32::Register(FAT32_FolderStructure* node, const std::string& path)
+{
+	nodesByPath[path] = node;
+
+	if (node->entry.name[0] != '.' && node->entry.cluster >= 2)
+	{
+		nodesByCluster[node->entry.cluster] = node;
+	}
+}
+
+void FAT32::Unregister(FAT32_FolderStructure* node, const std::string& path)
+{
+	for (uint32_t i = 0; i < node->childCount; i++)
+	{
+		FAT32_FolderStructure* child = GetChild(node, i);
+		Unregister(child, path + '/' + child->entry.name);
+	}
+
+	auto byPath = nodesByPath.find(path);
+	if (byPath != nodesByPath.end() && byPath->second == node)
+	{
+		nodesByPath.erase(byPath);
+	}
+
+	auto byCluster = nodesByCluster.find(node->entry.cluster);
+	if (byCluster != nodesByCluster.end() && byCluster->second == node)
+	{
+		nodesByCluster.erase(byCluster);
+	}
+}
+
+std::string FAT32::GetPath(const FAT32_FolderStructure* node) const
+{
+	std::vector<const FAT32_FolderStructure*> structs;
+	while (node->parent)
+	{
+		structs.push_back(node);
+		node = node->parent;
+	}
+
+	std::string name = "~";
+	for (auto it = structs.rbegin(); it != structs.rend(); ++it)
+	{
+		name += '/';
+		name += (*it)->entry.name;
+	}
+
+	return name;
+}
+
+void FAT32::PrefetchTree()
+{
+	//Directories are queued by path, a node may be deleted before its turn comes
+	std::vector<std::string> toLoad = { "~" };
+	std::vector<std::string> next;
+
+	while (!toLoad.empty() && !stopPrefetch)
+	{
+		for (const auto& path : toLoad)
+		{
+			if (stopPrefetch)
+			{
+				return;
+			}
+
+			std::lock_guard<std::recursive_mutex> guard(treeLock);
+
+			FAT32_FolderStructure* dir = LoadPath(path);
+			if (dir == nullptr)
+			{
+				continue;
+			}
+
+			LoadChildren(dir);
+			for (uint32_t i = 0; i < dir->childCount; i++)
+			{
+				FAT32_FolderStructure* child = GetChild(dir, i);
+				if (!child->loaded)
+				{
+					next.push_back(path + '/' + child->entry.name);
+				}
+			}
+		}
+
+		toLoad.swap(next);
+		next.clear();
+	}
 }
@@ -2,13 +2,45 @@
 #define FAT32_H
 
 #include "FAT32Driver.h"
+#include "NameArena.h"
+#include "SlabArena.h"
 
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+//A DirEntry without the name buffer, the name is interned in the FAT32's name arena
+struct FAT32_NodeEntry
+{
+	const char* name = "";
+	uint32_t cluster = 0;
+	uint32_t size = 0;
+	uint8_t attributes = 0;
+
+	uint32_t parentCluster = 0;
+	uint32_t offsetInParentCluster = 0;
+
+	//The driver's form of the entry, for the calls that take one
+	DirEntry ToDirEntry() const;
+};
+
+//The nodes live in the FAT32's arena, they are only valid as long as the FAT32 is
 struct FAT32_FolderStructure
 {
-	FAT32_FolderStructure* parent;
-	DirEntry entry;
+	FAT32_FolderStructure* parent = nullptr;
+	FAT32_NodeEntry entry;
+
+	//A directory's children are read from the disk the first time they're needed, files have nothing to load
+	bool loaded = false;
 
-	std::vector<FAT32_FolderStructure*> children;
+	uint32_t index = 0; //In the arena
+
+	//The children are the childCount node indices from childStart in the FAT32's child index pool
+	uint32_t childStart = 0;
+	uint32_t childCount = 0;
+	uint32_t childCapacity = 0;
 };
 
 struct FAT32_OpenFile
@@ -18,10 +50,25 @@ struct FAT32_OpenFile
 	const char* path;
 };
 
+//The driver of a FAT32 with its tree locked, the prefetch thread can't use the driver while the handle exists
+class FAT32_DriverHandle
+{
+public:
+	FAT32_DriverHandle(FAT32Driver* driver, std::recursive_mutex& lock) : driver(driver), guard(lock) {}
+
+	FAT32Driver* operator->() const { return driver; }
+	FAT32Driver* Get() const { return driver; }
+
+private:
+	FAT32Driver* driver;
+	std::unique_lock<std::recursive_mutex> guard;
+};
+
 class FAT32
 {
 public:
-	FAT32(const std::string& file);
+	//The tree is filled in as directories are accessed, if prefetchTree is set a background thread reads the rest of it
+	FAT32(const std::string& file, BlockDeviceType type = BlockDeviceType::File, bool prefetchTree = false);
 	~FAT32();
 
 	FAT32_OpenFile* OpenFile(const std::string& path);
@@ -33,29 +80,86 @@ public:
 	int WriteFile(FAT32_OpenFile* file, void* buffer, uint64_t nBytes);
 	int ResizeFile(FAT32_OpenFile* file, uint64_t new_size);
 
-	FAT32_FolderStructure* GetRoot() const { return root; }
-	FAT32_FolderStructure* GetCurrent() const { return current; }
+	int Sync() { std::lock_guard<std::recursive_mutex> guard(treeLock); return driver->Sync(); }
+
+	//These lock the tree too, the prefetch thread may be changing it
+	FAT32_FolderStructure* GetRoot() const { std::lock_guard<std::recursive_mutex> guard(treeLock); return root; }
+	FAT32_FolderStructure* GetCurrent() const { std::lock_guard<std::recursive_mutex> guard(treeLock); return current; }
 
-	void AddToRecords(const std::string& path, DirEntry entry);
+	//The node of the file or directory starting at cluster, nullptr if it isn't loaded
+	FAT32_FolderStructure* GetFolderByCluster(uint32_t cluster);
+
+	//The loaded children of dir (ListCurrent and GoTo load them)
+	uint32_t GetChildCount(const FAT32_FolderStructure* dir) const { std::lock_guard<std::recursive_mutex> guard(treeLock); return dir->childCount; }
+	FAT32_FolderStructure* GetChild(const FAT32_FolderStructure* dir, uint32_t index) const;
+
+	void AddToRecords(const std::string& path, const DirEntry& entry);
 	void DeleteFromRecords(const std::string& name);
 
 	std::string GetCurrentDirectory() const;
 
-	FAT32Driver* GetDriver() { return driver; }
+	//The tree stays locked as long as the handle is kept, the pointer mustn't be used after it's gone
+	FAT32_DriverHandle GetDriver() { return FAT32_DriverHandle(driver, treeLock); }
 
 	void ListCurrent();
 	void GoTo(char* name);
 
 private:
-	FAT32_FolderStructure* RetrieveFromRoot(DirEntry entry);
+	//Reads the directory's entries into its children, if they haven't been read yet
+	void LoadChildren(FAT32_FolderStructure* dir);
 
-	FAT32_FolderStructure* GetFolderByCluster(uint32_t cluster);
-	std::vector<FAT32_FolderStructure*> GetAllEntries(FAT32_FolderStructure* top);
+	//Returns the node of path, loading the directories on the way, nullptr if there's no such file
+	FAT32_FolderStructure* LoadPath(const std::string& path);
+
+	//Allocates a node in the arena and appends it to parent's children (if there's a parent)
+	FAT32_FolderStructure* NewNode(FAT32_FolderStructure* parent, const DirEntry& entry);
+
+	//Returns the node and everything under it to the arena
+	void FreeNode(FAT32_FolderStructure* node);
+
+	void AddChild(FAT32_FolderStructure* dir, uint32_t child);
+	void RemoveChild(FAT32_FolderStructure* dir, uint32_t child);
+
+	//Takes a range of capacity from the free ranges (or the end of the pool), and gives one back
+	uint32_t AllocRange(uint32_t capacity);
+	void FreeRange(uint32_t start, uint32_t capacity);
+
+	//Adds the node to (or removes the node and everything under it from) the path and cluster indices
+	void Register(FAT32_FolderStructure* node, const std::string& path);
+	void Unregister(FAT32_FolderStructure* node, const std::string& path);
+
+	std::string GetPath(const FAT32_FolderStructure* node) const;
+
+	//Loads every directory breadth first, one directory per lock, until it's done or the FAT32 is destroyed
+	void PrefetchTree();
 
 	FAT32Driver* driver;
 
 	FAT32_FolderStructure* root;
 	FAT32_FolderStructure* current;
+
+	//Every node of the tree, the ones loaded together are next to each other
+	SlabArena<FAT32_FolderStructure> nodes;
+
+	//The children of every directory, each directory's are one range of it
+	//A full range that isn't at the end is moved with twice the room, the ranges left behind
+	//(and the ones of freed directories) are reused by later ones instead of growing the pool
+	std::vector<uint32_t> childIndices;
+
+	//The free ranges of the child index pool, by capacity
+	std::multimap<uint32_t, uint32_t> freeRanges;
+
+	//The names of the nodes, each distinct name once
+	NameArena names;
+
+	//Every loaded node by its full path ("~/USR/FILES") and by its first cluster ('.' and '..' entries aren't in the latter)
+	std::unordered_map<std::string, FAT32_FolderStructure*> nodesByPath;
+	std::unordered_map<uint32_t, FAT32_FolderStructure*> nodesByCluster;
+
+	//Guards the tree and the driver against the prefetch thread
+	mutable std::recursive_mutex treeLock;
+	std::thread prefetchThread;
+	std::atomic<bool> stopPrefetch{ false };
 };
 
 #endif
\ No newline at end of file
@@ -2,18 +2,19 @@
 
 #include <string>
 
-FAT32Driver::FAT32Driver(const std::string& image)
+FAT32Driver::FAT32Driver(const std::string& image, BlockDeviceType type)
 {
-	file.open(image, std::ios::in | std::ios::out | std::ios::binary);
+	device = BlockDevice::Open(image, type);
+	cache = &BufferCache::Shared();
 
-	if (!file.is_open())
+	if (device == nullptr)
 	{
 		std::cerr << "ERROR: " << image << " could not be opened!\n";
 		return;
 	}
 
 	BootSector = new FAT32_BootSector();
-	file.read((char*)BootSector, sizeof(FAT32_BootSector));
+	device->Read(0, BootSector, sizeof(FAT32_BootSector));
 
  	FirstDataSector = BootSector->NumberOfFATs * BootSector->SectorsPerFAT32 + BootSector->ReservedSectors;
 	BootSector->Reserved0 = FirstDataSector;
@@ -32,35 +33,61 @@ FAT32Driver::FAT32Driver(const std::string& image)
 
 	TotalClusters = TotalSectors / BootSector->SectorsPerCluster;
 
-	temporaryBuffer = new uint8_t[ClusterSize];
-	temporaryBuffer2 = new uint8_t[ClusterSize];
+	scratch = new ScratchPool(ClusterSize);
 
-	FATcache = new uint8_t[BootSector->SectorsPerFAT32 * BootSector->BytesPerSector];
-	file.seekg(BootSector->ReservedSectors * BootSector->BytesPerSector);
-	file.read((char*)FATcache, BootSector->SectorsPerFAT32 * BootSector->BytesPerSector);
+	FATcache = new FATCache(device, (uint64_t)BootSector->ReservedSectors * BootSector->BytesPerSector, (uint64_t)BootSector->SectorsPerFAT32 * BootSector->BytesPerSector,
+		BootSector->BytesPerSector, BootSector->NumberOfFATs);
+
+	//TotalClusters counts the reserved sectors and the FATs too
+	DataClusters = (TotalSectors - FirstDataSector) / BootSector->SectorsPerCluster;
+	if ((uint64_t)DataClusters + 2 > FATcache->GetEntryCount())
+	{
+		DataClusters = (uint32_t)FATcache->GetEntryCount() - 2;
+	}
+
+	FileSystemInfo = new FSInfo();
+	device->Read((uint64_t)BootSector->FSInfoSector * BootSector->BytesPerSector, FileSystemInfo, sizeof(FSInfo));
+
+	FSInfoValid = (FileSystemInfo->LeadSignature == 0x41615252) && (FileSystemInfo->StructSignature == 0x61417272) && (FileSystemInfo->TrailSignature == 0xAA550000);
+	if (FSInfoValid)
+	{
+		//Both fields are only hints, anything out of range means unknown
+		if (FileSystemInfo->FreeSpace > DataClusters)
+		{
+			FileSystemInfo->FreeSpace = 0xFFFFFFFF;
+		}
+
+		if (FileSystemInfo->LastWritten < 2 || FileSystemInfo->LastWritten >= DataClusters + 2)
+		{
+			FileSystemInfo->LastWritten = 0xFFFFFFFF;
+		}
+	}
+	else
+	{
+		FileSystemInfo->FreeSpace = 0xFFFFFFFF;
+		FileSystemInfo->LastWritten = 0xFFFFFFFF;
+	}
 }
 
 FAT32Driver::~FAT32Driver()
 {
-	file.seekg(0);
-	file.write((const char*)BootSector, 512);
-	file.seekg(BootSector->BackupBootSector * BootSector->BytesPerSector);
-	file.write((const char*)BootSector, 512);
-	
-	file.seekg(BootSector->ReservedSectors * BootSector->BytesPerSector);
-	file.write((const char*)FATcache, BootSector->SectorsPerFAT32 * BootSector->BytesPerSector);
-
-	//copy the first FAT onto the other ones upon closing the FS
-	for (uint32_t i = 1; i < BootSector->NumberOfFATs; i++)
+	if (device == nullptr)
 	{
-		file.seekg(BootSector->ReservedSectors * BootSector->BytesPerSector + BootSector->SectorsPerFAT32 * BootSector->BytesPerSector * i);
-		file.write((const char*)FATcache, BootSector->SectorsPerFAT32 * BootSector->BytesPerSector);
+		return;
 	}
 
-	delete[] FATcache;
-	delete[] temporaryBuffer;
-	delete[] temporaryBuffer2;
+	device->Write(0, BootSector, 512);
+	device->Write((uint64_t)BootSector->BackupBootSector * BootSector->BytesPerSector, BootSector, 512);
+
+	Sync();
+
+	delete FATcache;
+	delete allocator;
+	delete FileSystemInfo;
+	delete scratch;
 	delete BootSector;
+	cache->Invalidate(device);
+	delete device;
 }
 
 uint32_t FAT32Driver::ReadFAT(uint32_t cluster)
@@ -70,8 +97,7 @@ uint32_t FAT32Driver::ReadFAT(uint32_t cluster)
 		return -1;
 	}
 
-	uint32_t* FATtable = (uint32_t*)FATcache;
-	return FATtable[cluster] & 0x0FFFFFFF;
+	return FATcache->Get(cluster) & 0x0FFFFFFF;
 }
 
 uint32_t FAT32Driver::WriteFAT(uint32_t cluster, uint32_t value)
@@ -81,12 +107,76 @@ uint32_t FAT32Driver::WriteFAT(uint32_t cluster, uint32_t value)
 		return -1;
 	}
 
-	uint32_t* FATtable = (uint32_t*)FATcache;
-	FATtable[cluster] &= 0xF0000000;
-	FATtable[cluster] |= (value & 0x0FFFFFFF);
+	//The top 4 bits are reserved and have to be kept
+	uint32_t entry = FATcache->Get(cluster);
+	FATcache->Set(cluster, (entry & 0xF0000000) | (value & 0x0FFFFFFF));
 	return 0;
 }
 
+int FAT32Driver::Sync()
+{
+	//Data first, then the FAT linking it, then the directory entries pointing at the chains, so a crash in between never leaves an entry pointing at garbage
+	int ret = cache->Sync(device, BlockKind::Data);
+
+	//Only the modified FAT sectors are written, to every copy of the FAT
+	if (FATcache->Flush() != 0)
+	{
+		ret = -1;
+	}
+
+	//The FSInfo sector is only touched if it was valid to begin with, there's a copy after the backup boot sector too
+	if (FSInfoValid && FSInfoDirty)
+	{
+		if (device->Write((uint64_t)BootSector->FSInfoSector * BootSector->BytesPerSector, FileSystemInfo, sizeof(FSInfo)) != 0)
+		{
+			ret = -1;
+		}
+
+		if (BootSector->BackupBootSector != 0)
+		{
+			device->Write((uint64_t)(BootSector->BackupBootSector + 1) * BootSector->BytesPerSector, FileSystemInfo, sizeof(FSInfo));
+		}
+
+		FSInfoDirty = false;
+	}
+
+	if (cache->Sync(device, BlockKind::Metadata) != 0)
+	{
+		ret = -1;
+	}
+
+	if (device->Flush() != 0)
+	{
+		ret = -1;
+	}
+
+	return ret;
+}
+
+void FAT32Driver::SetWriteBack(bool enabled)
+{
+	if (writeBack && !enabled)
+	{
+		Sync();
+	}
+
+	writeBack = enabled;
+}
+
+void FAT32Driver::SyncIfNeeded()
+{
+	if (writeBack && cache->NeedsSync(device))
+	{
+		Sync();
+	}
+}
+
+uint64_t FAT32Driver::GetClusterOffset(uint32_t cluster)
+{
+	uint64_t start_sector = (uint64_t)(cluster - 2) * BootSector->SectorsPerCluster + FirstDataSector;
+	return start_sector * BootSector->BytesPerSector;
+}
+
 uint32_t FAT32Driver::ReadCluster(uint32_t cluster, void* buffer)
 {
 	if (cluster < 2 || cluster > TotalClusters)
@@ -94,25 +184,86 @@ uint32_t FAT32Driver::ReadCluster(uint32_t cluster, void* buffer)
 		return -1;
 	}
 
-	uint32_t start_sector = (cluster - 2) * BootSector->SectorsPerCluster + FirstDataSector;
-	file.seekg(start_sector * BootSector->BytesPerSector);
-	file.read((char*)buffer, ClusterSize);
-	return 0;
+	return cache->Read(device, GetClusterOffset(cluster), buffer, ClusterSize);
 }
 
-uint32_t FAT32Driver::WriteCluster(uint32_t cluster, void* buffer)
+uint32_t FAT32Driver::WriteCluster(uint32_t cluster, void* buffer, BlockKind kind)
 {
 	if (cluster < 2 || cluster > TotalClusters)
 	{
 		return -1;
 	}
 
-	uint32_t start_sector = (cluster - 2) * BootSector->SectorsPerCluster + FirstDataSector;
-	file.seekg(start_sector * BootSector->BytesPerSector);
-	file.write((char*)buffer, ClusterSize);
+	if (writeBack)
+	{
+		return cache->WriteBack(device, GetClusterOffset(cluster), buffer, ClusterSize, kind);
+	}
+
+	return cache->Write(device, GetClusterOffset(cluster), buffer, ClusterSize);
+}
+
+uint32_t FAT32Driver::WriteClusterRun(uint32_t cluster, uint32_t count, void* buffer)
+{
+	if (cluster < 2 || count == 0 || (cluster + count - 1) > TotalClusters)
+	{
+		return -1;
+	}
+
+	uint8_t* buff = (uint8_t*)buffer;
+
+	//Write-back blocks are merged by Sync anyway, they only have to land in the cache one cluster at a time
+	if (writeBack)
+	{
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (cache->WriteBack(device, GetClusterOffset(cluster + i), buff + (uint64_t)i * ClusterSize, ClusterSize, BlockKind::Data) != 0)
+			{
+				return -1;
+			}
+		}
+
+		return 0;
+	}
+
+	uint32_t perTransfer = (uint32_t)(cache->GetMaxTransfer() / ClusterSize);
+	if (perTransfer == 0)
+	{
+		perTransfer = 1;
+	}
+
+	while (count)
+	{
+		uint32_t now = (count > perTransfer) ? perTransfer : count;
+		if (cache->WriteRange(device, GetClusterOffset(cluster), buff, (uint64_t)now * ClusterSize, ClusterSize) != 0)
+		{
+			return -1;
+		}
+
+		cluster += now;
+		count -= now;
+		buff += (uint64_t)now * ClusterSize;
+	}
+
 	return 0;
 }
 
+uint8_t* FAT32Driver::GetCluster(uint32_t cluster, void* buffer)
+{
+	if (cluster < 2 || cluster > TotalClusters)
+	{
+		return nullptr;
+	}
+
+	uint8_t* mapped = device->Map(GetClusterOffset(cluster), ClusterSize);
+	if (mapped)
+	{
+		return mapped;
+	}
+
+	ReadCluster(cluster, buffer);
+	return (uint8_t*)buffer;
+}
+
 std::vector<uint32_t> FAT32Driver::GetClusterChain(uint32_t start)
 {
 	if (start < 2 || start > TotalClusters)
@@ -144,63 +295,207 @@ std::vector<uint32_t> FAT32Driver::GetClusterChain(uint32_t start)
 	return chain;
 }
 
-uint32_t FAT32Driver::AllocateClusterChain(uint32_t size)
+const ExtentMap& FAT32Driver::GetExtentMap(uint32_t start)
 {
-	uint32_t totalAllocated = 0;
+	auto it = extentMaps.find(start);
+	if (it != extentMaps.end())
+	{
+		return it->second;
+	}
 
-	uint32_t cluster = 2;
-	uint32_t prevCluster = cluster;
-	uint32_t firstCluster = 0;
-	uint32_t clusterStatus = FREE_CLUSTER;
+	if (extentMaps.size() >= MaxExtentMaps)
+	{
+		extentMaps.clear();
+	}
 
-	while (totalAllocated < size)
+	ExtentMap& map = extentMaps[start];
+	if (start < 2 || start > TotalClusters)
 	{
-		if (cluster >= TotalClusters)
+		return map;
+	}
+
+	uint32_t current = start;
+	while (true)
+	{
+		map.Append(current);
+
+		current = ReadFAT(current);
+		if (current == BAD_CLUSTER || map.GetLength() > TotalClusters)
 		{
-			return BAD_CLUSTER;
+			//Same as GetClusterChain, a broken chain is an empty one
+			map.Clear();
+			break;
 		}
 
-		clusterStatus = ReadFAT(cluster);
-		if (clusterStatus == FREE_CLUSTER)
+		if (current >= END_CLUSTER)
 		{
-			if (totalAllocated != 0)
-			{
-				if (WriteFAT(prevCluster, cluster) != 0)
-				{
-					return BAD_CLUSTER;
-				}
-			}
-			else
-			{
-				firstCluster = cluster;
-			}
-			
-			if (totalAllocated == (size - 1))
-			{
-				if (WriteFAT(cluster, END_CLUSTER) != 0)
-				{
-					return BAD_CLUSTER;
-				}
-			}
+			break;
+		}
+	}
+
+	return map;
+}
 
-			totalAllocated++;
-			prevCluster = cluster;
+void FAT32Driver::InvalidateExtentMap(uint32_t start)
+{
+	extentMaps.erase(start);
+}
+
+uint32_t FAT32Driver::AllocateClusterChain(uint32_t size, uint32_t hint)
+{
+	if (size == 0)
+	{
+		return 0;
+	}
+
+	//Without a better idea, carry on after the last cluster handed out
+	if (hint == 0 && FileSystemInfo->LastWritten != 0xFFFFFFFF)
+	{
+		hint = FileSystemInfo->LastWritten + 1;
+	}
+
+	std::vector<uint32_t> clusters;
+	if (!GetAllocator()->Allocate(size, hint, clusters))
+	{
+		return BAD_CLUSTER;
+	}
+
+	FileSystemInfo->FreeSpace = allocator->GetFreeCount();
+	FileSystemInfo->LastWritten = clusters.back();
+	FSInfoDirty = true;
+
+	for (uint32_t i = 0; i < clusters.size(); i++)
+	{
+		uint32_t next = (i == (clusters.size() - 1)) ? END_CLUSTER : clusters[i + 1];
+		if (WriteFAT(clusters[i], next) != 0)
+		{
+			return BAD_CLUSTER;
 		}
+	}
+
+	return clusters[0];
+}
 
-		cluster++;
+void FAT32Driver::ReadAhead(const DirEntry& fileMeta, const ExtentMap& map, uint64_t offset, uint64_t bytes)
+{
+	uint64_t start = 0;
+	uint64_t length = 0;
+	if (!readahead.Access(fileMeta.cluster, offset, bytes, start, length) || start >= fileMeta.size)
+	{
+		return;
 	}
 
-	return firstCluster;
+	uint64_t end = start + length;
+	if (end > fileMeta.size)
+	{
+		end = fileMeta.size;
+	}
+
+	//Every physically contiguous run of the window is a single hint
+	uint64_t i = start / ClusterSize;
+	uint64_t last = (end - 1) / ClusterSize;
+	while (i <= last)
+	{
+		uint64_t contiguous = 0;
+		uint32_t clus = (uint32_t)map.Lookup(i, &contiguous);
+		if (clus == 0)
+		{
+			return;
+		}
+
+		uint64_t count = last - i + 1;
+		if (count > contiguous)
+		{
+			count = contiguous;
+		}
+
+		device->Prefetch(GetClusterOffset(clus), count * ClusterSize);
+		i += count;
+	}
 }
 
 void FAT32Driver::FreeClusterChain(uint32_t start)
 {
+	InvalidateExtentMap(start);
+	readahead.Forget(start);
+
 	std::vector<uint32_t> chain = GetClusterChain(start);
 
 	for (uint32_t i = 0; i < chain.size(); i++)
 	{
 		WriteFAT(chain[i], FREE_CLUSTER);
+
+		if (allocator)
+		{
+			allocator->Free(chain[i]);
+		}
+	}
+
+	if (allocator)
+	{
+		FileSystemInfo->FreeSpace = allocator->GetFreeCount();
+	}
+	else if (FileSystemInfo->FreeSpace != 0xFFFFFFFF)
+	{
+		FileSystemInfo->FreeSpace += chain.size();
+	}
+
+	FSInfoDirty = true;
+}
+
+uint32_t FAT32Driver::GetFreeClusters()
+{
+	if (FileSystemInfo->FreeSpace == 0xFFFFFFFF)
+	{
+		FileSystemInfo->FreeSpace = GetAllocator()->GetFreeCount();
+		FSInfoDirty = true;
+	}
+
+	return FileSystemInfo->FreeSpace;
+}
+
+ClusterAllocator* FAT32Driver::GetAllocator()
+{
+	if (allocator)
+	{
+		return allocator;
+	}
+
+	allocator = new ClusterAllocator(2, DataClusters);
+
+	uint32_t runStart = 0;
+	uint32_t runLength = 0;
+	for (uint32_t cluster = 2; cluster < DataClusters + 2; cluster++)
+	{
+		if (ReadFAT(cluster) == FREE_CLUSTER)
+		{
+			if (runLength == 0)
+			{
+				runStart = cluster;
+			}
+
+			runLength++;
+		}
+		else if (runLength)
+		{
+			allocator->MarkFree(runStart, runLength);
+			runLength = 0;
+		}
+	}
+
+	if (runLength)
+	{
+		allocator->MarkFree(runStart, runLength);
+	}
+
+	//The FAT is the authority, whatever FSInfo said before
+	if (FileSystemInfo->FreeSpace != allocator->GetFreeCount())
+	{
+		FileSystemInfo->FreeSpace = allocator->GetFreeCount();
+		FSInfoDirty = true;
 	}
+
+	return allocator;
 }
 
 void* FAT32Driver::ReadClusterChain(uint32_t start, uint32_t& size)
@@ -245,6 +540,8 @@ void FAT32Driver::WriteClusterChain(uint32_t start, void* buffer, uint32_t size)
 
 void FAT32Driver::ResizeClusterChain(uint32_t start, uint32_t new_size)
 {
+	InvalidateExtentMap(start);
+
 	std::vector<uint32_t> chain = GetClusterChain(start);
 	uint32_t cur_size = chain.size();
 
@@ -259,21 +556,23 @@ void FAT32Driver::ResizeClusterChain(uint32_t start, uint32_t new_size)
 	}
 	else
 	{
-		uint32_t start_of_the_rest = AllocateClusterChain(new_size - cur_size);
+		uint32_t start_of_the_rest = AllocateClusterChain(new_size - cur_size, chain[cur_size - 1] + 1);
 		WriteFAT(chain[cur_size - 1], start_of_the_rest);
 	}
 }
 
-void FAT32Driver::GetDirectoriesOnCluster(uint32_t cluster, std::vector<DirEntry>& entries)
+void FAT32Driver::ForEachEntry(uint32_t cluster, const std::function<bool(const DirEntry&)>& callback)
 {
 	if (cluster < 2 || cluster > TotalClusters)
 	{
 		return;
 	}
 
-	ReadCluster(cluster, temporaryBuffer);
+	//One cluster of the directory is held at a time, however long it is
+	ScratchBuffer temporaryBuffer(*scratch);
+	uint8_t* data = GetCluster(cluster, temporaryBuffer);
 
-	DirectoryEntry* metadata = (DirectoryEntry*)temporaryBuffer;
+	DirectoryEntry* metadata = (DirectoryEntry*)data;
 	uint32_t meta_pointer_iterator = 0;
 
 	bool LFN = false;
@@ -286,43 +585,52 @@ void FAT32Driver::GetDirectoriesOnCluster(uint32_t cluster, std::vector<DirEntry
 		else if ((metadata->name[0] == (char)ENTRY_FREE) || ((metadata->attributes & FILE_LONG_NAME) == FILE_LONG_NAME))
 		{
 			LFN = ((metadata->attributes & FILE_LONG_NAME) == FILE_LONG_NAME);
-
-			//If we are under the cluster limit
-			if (meta_pointer_iterator < ClusterSize / sizeof(DirectoryEntry) - 1)
-			{
-				metadata++;
-				meta_pointer_iterator++;
-			}
-			//Search next cluster
-			else
-			{
-				uint32_t next_cluster = ReadFAT(cluster);
-				if (next_cluster >= END_CLUSTER)
-				{
-					break;
-				}
-				else
-				{
-					//Search next cluster
-					return GetDirectoriesOnCluster(next_cluster, entries);
-				}
-			}
 		}
 		else
 		{
 			DirEntry entry = FromFATEntry(metadata, LFN);
 			entry.parentCluster = cluster;
 			entry.offsetInParentCluster = meta_pointer_iterator;
-			entries.push_back(entry);
 
 			LFN = false;
 
+			if (!callback(entry))
+			{
+				break;
+			}
+		}
+
+		//If we are under the cluster limit
+		if (meta_pointer_iterator < ClusterSize / sizeof(DirectoryEntry) - 1)
+		{
 			metadata++;
 			meta_pointer_iterator++;
 		}
+		//Search next cluster
+		else
+		{
+			cluster = ReadFAT(cluster);
+			if (cluster < 2 || cluster >= END_CLUSTER)
+			{
+				break;
+			}
+
+			data = GetCluster(cluster, temporaryBuffer);
+			metadata = (DirectoryEntry*)data;
+			meta_pointer_iterator = 0;
+		}
 	}
 }
 
+void FAT32Driver::GetDirectoriesOnCluster(uint32_t cluster, std::vector<DirEntry>& entries)
+{
+	ForEachEntry(cluster, [&](const DirEntry& entry)
+	{
+		entries.push_back(entry);
+		return true;
+	});
+}
+
 std::vector<DirEntry> FAT32Driver::GetDirectories(uint32_t cluster, uint32_t filter_attributes, bool exclude)
 {
 	std::vector<DirEntry> ret;
@@ -331,33 +639,21 @@ std::vector<DirEntry> FAT32Driver::GetDirectories(uint32_t cluster, uint32_t fil
 		return ret;
 	}
 
-	std::vector<DirEntry> all;
-	GetDirectoriesOnCluster(cluster, all);
-
-	for (auto elem : all)
+	//Only the entries that pass the filter are kept
+	ForEachEntry(cluster, [&](const DirEntry& elem)
 	{
-		if (!exclude)
+		if (((elem.attributes & filter_attributes) != 0) == exclude)
 		{
-			if (elem.attributes & filter_attributes)
-			{
-				continue;
-			}
-
 			ret.push_back(elem);
 		}
-		else
-		{
-			if (elem.attributes & filter_attributes)
-			{
-				ret.push_back(elem);
-			}
-		}
-	}
+
+		return true;
+	});
 
 	return ret;
 }
 
-void FAT32Driver::ModifyDirectoryEntry(uint32_t cluster, const char* name, DirEntry modified)
+void FAT32Driver::ModifyDirectoryEntry(uint32_t cluster, const char* name, const DirEntry& modified)
 {
 	bool isLFN = false;
 	if (IsFATFormat((char*)name) != 0)
@@ -365,9 +661,10 @@ void FAT32Driver::ModifyDirectoryEntry(uint32_t cluster, const char* name, DirEn
 		isLFN = true;
 	}
 
-	ReadCluster(cluster, temporaryBuffer);
+	ScratchBuffer temporaryBuffer(*scratch);
+	uint8_t* data = GetCluster(cluster, temporaryBuffer);
 
-	DirectoryEntry* metadata = (DirectoryEntry*)temporaryBuffer;
+	DirectoryEntry* metadata = (DirectoryEntry*)data;
 	uint32_t meta_pointer_iterator = 0;
 
 	uint32_t count = 0;
@@ -379,7 +676,7 @@ void FAT32Driver::ModifyDirectoryEntry(uint32_t cluster, const char* name, DirEn
 		{
 			break;
 		}
-		else if (((metadata->attributes & FILE_LONG_NAME) == FILE_LONG_NAME) || !(Compare(metadata, name, isLFN)))
+		else if (((metadata->attributes & FILE_LONG_NAME) == FILE_LONG_NAME) || !(Compare(metadata, name, isLFN && (meta_pointer_iterator != 0))))
 		{
 			//If we are under the cluster limit
 			if (meta_pointer_iterator < ClusterSize / sizeof(DirectoryEntry) - 1)
@@ -404,6 +701,10 @@ void FAT32Driver::ModifyDirectoryEntry(uint32_t cluster, const char* name, DirEn
 		}
 		else
 		{
+			//The indexed copy of the entry (if its directory is indexed) changes with it
+			uint64_t directory = directoryIndex.GetDirectory(cluster);
+			dentries.RemoveAt(cluster, name);
+
 			if (modified.attributes == 0)
 			{
 				//We want to delete the entry altogether
@@ -412,16 +713,26 @@ void FAT32Driver::ModifyDirectoryEntry(uint32_t cluster, const char* name, DirEn
 					DirectoryEntry* curr = metadata - i;
 					curr->name[0] = ENTRY_FREE;
 				}
+
+				directoryIndex.Remove(directory, name);
 			}
 			else
 			{
 				metadata->attributes = modified.attributes;
 				metadata->clusterLow = modified.cluster & 0xFFFF;
-				metadata->clusterHigh = (modified.cluster << 16) & 0xFFFF;
+				metadata->clusterHigh = (modified.cluster >> 16) & 0xFFFF;
 				metadata->fileSize = modified.size;
+
+				DirEntry* indexed = directoryIndex.Find(directory, name);
+				if (indexed)
+				{
+					indexed->attributes = modified.attributes;
+					indexed->cluster = modified.cluster;
+					indexed->size = modified.size;
+				}
 			}
 
-			WriteCluster(cluster, temporaryBuffer);
+			WriteCluster(cluster, data);
 			break;
 		}
 	}
@@ -434,10 +745,10 @@ int FAT32Driver::PrepareAddedDirectory(uint32_t cluster)
 		return -1;
 	}
 
-	char* tempBuff = new char[ClusterSize];
+	ScratchBuffer tempBuff(*scratch);
 	ReadCluster(cluster, tempBuff);
 
-	DirectoryEntry* metadata = (DirectoryEntry*)tempBuff;
+	DirectoryEntry* metadata = (DirectoryEntry*)tempBuff.Get();
 	memset(metadata, 0, sizeof(DirectoryEntry));
 	memcpy(metadata->name, ".          ", 11);
 	metadata->attributes = FILE_DIRECTORY;
@@ -464,15 +775,15 @@ int FAT32Driver::PrepareAddedDirectory(uint32_t cluster)
 	metadata->mtime_time = GetTime();
 
 	WriteCluster(cluster, tempBuff);
-	delete[] tempBuff;
 
 	return 0;
 }
 
-void FAT32Driver::CleanFileEntry(uint32_t cluster, DirEntry entry)
+void FAT32Driver::CleanFileEntry(uint32_t cluster, const DirEntry& entry)
 {
-	entry.attributes = 0;
-	ModifyDirectoryEntry(cluster, entry.name, entry);
+	DirEntry cleaned = entry;
+	cleaned.attributes = 0;
+	ModifyDirectoryEntry(cluster, entry.name, cleaned);
 }
 
 int FAT32Driver::DirectorySearch(const char* FilePart, uint32_t cluster, DirEntry* file)
@@ -482,41 +793,48 @@ int FAT32Driver::DirectorySearch(const char* FilePart, uint32_t cluster, DirEntr
 		return -1;
 	}
 
-	std::vector<DirEntry> entries;
-	GetDirectoriesOnCluster(cluster, entries);
+	DentryCache<DirEntry>::Result cached = dentries.Lookup(cluster, FilePart, file);
+	if (cached != DentryCache<DirEntry>::Result::Unknown)
+	{
+		return (cached == DentryCache<DirEntry>::Result::Found) ? 0 : -2;
+	}
 
-	for (auto entry : entries)
+	//The directory is only decoded the first time, after that every lookup is a hash lookup
+	if (!directoryIndex.IsIndexed(cluster))
 	{
-		if (strcmp(entry.name, FilePart) == 0)
-		{
-			if (file != nullptr)
-			{
-				*file = entry;
-			}
+		std::vector<DirEntry> entries;
+		GetDirectoriesOnCluster(cluster, entries);
+		directoryIndex.Build(cluster, entries, GetClusterChain(cluster));
+	}
 
-			return 0;
-		}
+	DirEntry* entry = directoryIndex.Find(cluster, FilePart);
+	if (entry == nullptr)
+	{
+		dentries.InsertNegative(cluster, FilePart);
+		return -2;
+	}
+
+	dentries.Insert(cluster, FilePart, *entry, entry->parentCluster);
+
+	if (file != nullptr)
+	{
+		*file = *entry;
 	}
 
-	return -2;
+	return 0;
 }
 
-int FAT32Driver::DirectoryAdd(uint32_t cluster, DirEntry file)
+int FAT32Driver::DirectoryAdd(uint32_t cluster, const DirEntry& file)
 {
 	if (cluster < 2 || cluster > TotalClusters)
 	{
 		return -1;
 	}
 
-	bool isLFN = false;
-	if (IsFATFormat(file.name) != 0)
-	{
-		isLFN = true;
-	}
-
-	ReadCluster(cluster, temporaryBuffer);
+	ScratchBuffer temporaryBuffer(*scratch);
+	uint8_t* data = GetCluster(cluster, temporaryBuffer);
 
-	DirectoryEntry* metadata = (DirectoryEntry*)temporaryBuffer;
+	DirectoryEntry* metadata = (DirectoryEntry*)data;
 	uint32_t meta_pointer_iterator = 0;
 
 	uint32_t count;
@@ -527,6 +845,9 @@ int FAT32Driver::DirectoryAdd(uint32_t cluster, DirEntry file)
 	{
 		if (((metadata->name[0] != (char)ENTRY_FREE) && (metadata->name[0] != ENTRY_END)))
 		{
+			//The long entries and the short one have to be consecutive
+			freeCount = 0;
+
 			if (meta_pointer_iterator < ClusterSize / sizeof(DirectoryEntry) - 1)
 			{
 				metadata++;
@@ -537,13 +858,11 @@ int FAT32Driver::DirectoryAdd(uint32_t cluster, DirEntry file)
 				uint32_t next_cluster = ReadFAT(cluster);
 				if (next_cluster >= END_CLUSTER)
 				{
-					next_cluster = AllocateClusterChain(1);
+					next_cluster = GrowDirectory(cluster);
 					if (next_cluster == BAD_CLUSTER)
 					{
 						return -1;
 					}
-
-					WriteFAT(cluster, next_cluster);
 				}
 
 				return DirectoryAdd(next_cluster, file);
@@ -563,16 +882,26 @@ int FAT32Driver::DirectoryAdd(uint32_t cluster, DirEntry file)
 				}
 				else
 				{
+					//The entry doesn't fit in what's left of this cluster, so the end of the directory moves to the next one
+					for (uint32_t i = 0; i < freeCount; i++)
+					{
+						DirectoryEntry* curr = metadata - i;
+						if (curr->name[0] == ENTRY_END)
+						{
+							curr->name[0] = ENTRY_FREE;
+						}
+					}
+
+					WriteCluster(cluster, data);
+
 					uint32_t next_cluster = ReadFAT(cluster);
 					if (next_cluster >= END_CLUSTER)
 					{
-						next_cluster = AllocateClusterChain(1);
+						next_cluster = GrowDirectory(cluster);
 						if (next_cluster == BAD_CLUSTER)
 						{
 							return -1;
 						}
-
-						WriteFAT(cluster, next_cluster);
 					}
 
 					return DirectoryAdd(next_cluster, file);
@@ -582,7 +911,9 @@ int FAT32Driver::DirectoryAdd(uint32_t cluster, DirEntry file)
 			if (((ent->attributes & FILE_VOLUME_ID) == FILE_VOLUME_ID) && ((ent->attributes & FILE_LONG_NAME) != FILE_LONG_NAME))
 			{
 				memcpy(metadata - count, ent - count, sizeof(DirectoryEntry) * (count + 1));
-				WriteCluster(cluster, temporaryBuffer); //Write the modified stuff back
+				WriteCluster(cluster, data); //Write the modified stuff back
+
+				IndexAddedEntry(cluster, metadata, count != 0, meta_pointer_iterator);
 				return 0;
 			}
 			
@@ -608,9 +939,16 @@ int FAT32Driver::DirectoryAdd(uint32_t cluster, DirEntry file)
 					return -1;
 				}
 
-				char* buffer = new char[clust_size * ClusterSize];
-				memset(buffer, 0, clust_size * ClusterSize);
-				WriteClusterChain(new_cluster, buffer, clust_size * ClusterSize);
+				//The new chain is cleared one cluster at a time from a single zeroed scratch buffer
+				ScratchBuffer zeroes(*scratch);
+				memset(zeroes, 0, ClusterSize);
+
+				uint32_t clus = new_cluster;
+				for (uint32_t i = 0; i < clust_size && clus >= 2 && clus < BAD_CLUSTER; i++)
+				{
+					WriteCluster(clus, zeroes);
+					clus = ReadFAT(clus);
+				}
 
 				if ((ent->attributes & FILE_DIRECTORY) == FILE_DIRECTORY) //A directory with pre-allocated clusters will definitely not need to be prepared
 				{
@@ -622,8 +960,9 @@ int FAT32Driver::DirectoryAdd(uint32_t cluster, DirEntry file)
 			}
 			
 			memcpy(metadata - count, ent - count, sizeof(DirectoryEntry) * (count + 1));
-			WriteCluster(cluster, temporaryBuffer); //Write the modified stuff back
+			WriteCluster(cluster, data); //Write the modified stuff back
 
+			IndexAddedEntry(cluster, metadata, count != 0, meta_pointer_iterator);
 			return 0;
 		}
 	}
@@ -631,6 +970,40 @@ int FAT32Driver::DirectoryAdd(uint32_t cluster, DirEntry file)
 	return -1;
 }
 
+uint32_t FAT32Driver::GrowDirectory(uint32_t cluster)
+{
+	uint32_t next_cluster = AllocateClusterChain(1, cluster + 1);
+	if (next_cluster == BAD_CLUSTER)
+	{
+		return BAD_CLUSTER;
+	}
+
+	//The cluster may hold data of a deleted file, which would read as entries
+	ScratchBuffer zeroes(*scratch);
+	memset(zeroes, 0, ClusterSize);
+	WriteCluster(next_cluster, zeroes);
+
+	WriteFAT(cluster, next_cluster);
+	directoryIndex.AddPart(next_cluster, directoryIndex.GetDirectory(cluster));
+
+	return next_cluster;
+}
+
+void FAT32Driver::IndexAddedEntry(uint32_t cluster, DirectoryEntry* entry, bool isLFN, uint32_t offset)
+{
+	uint64_t directory = directoryIndex.GetDirectory(cluster);
+	if (!directoryIndex.IsIndexed(directory))
+	{
+		return;
+	}
+
+	//Decoded back from the directory, so it's exactly what a fresh scan would find
+	DirEntry added = FromFATEntry(entry, isLFN);
+	added.parentCluster = cluster;
+	added.offsetInParentCluster = offset;
+	directoryIndex.Insert(directory, added);
+}
+
 int FAT32Driver::OpenFile(const char* filePath, DirEntry* fileMeta)
 {
 	if (fileMeta == nullptr)
@@ -668,15 +1041,17 @@ int FAT32Driver::CreateFile(const char* filePath, DirEntry* fileMeta)
 	}
 
 	retVal = DirectoryAdd(active_cluster, *fileMeta);
+	dentries.Remove(active_cluster, fileMeta->name);
 	if (retVal != 0)
 	{
 		return -1;
 	}
 
+	SyncIfNeeded();
 	return DirectorySearch(fileMeta->name, active_cluster, fileMeta);
 }
 
-int FAT32Driver::DeleteFile(DirEntry entry)
+int FAT32Driver::DeleteFile(const DirEntry& entry)
 {
 	if ((entry.attributes & FILE_DIRECTORY) == FILE_DIRECTORY)
 	{
@@ -686,74 +1061,117 @@ int FAT32Driver::DeleteFile(DirEntry entry)
 		{
 			DeleteFile(dir);
 		}
+
+		directoryIndex.Invalidate(entry.cluster);
+		dentries.RemoveDirectory(entry.cluster);
 	}
 
 	FreeClusterChain(entry.cluster);
 	CleanFileEntry(entry.parentCluster, entry);
 
+	SyncIfNeeded();
 	return 0;
 }
 
-int FAT32Driver::ReadFile(DirEntry fileMeta, uint64_t offset, void* buffer, uint64_t bytes)
+int FAT32Driver::ReadFile(const DirEntry& fileMeta, uint64_t offset, void* buffer, uint64_t bytes)
 {
 	if ((fileMeta.attributes & FILE_DIRECTORY) == FILE_DIRECTORY)
 	{
 		return -3;
 	}
 
+	if (offset >= fileMeta.size)
+	{
+		return 0;
+	}
+
 	if ((bytes + offset) > fileMeta.size)
 	{
 		bytes = fileMeta.size - offset;
 	}
 
-	std::vector<uint32_t> chain = GetClusterChain(fileMeta.cluster);
+	if (bytes == 0)
+	{
+		return 0;
+	}
+
+	const ExtentMap& map = GetExtentMap(fileMeta.cluster);
+
+	//The window after this read is requested first, the device loads it while this read is served and consumed
+	ReadAhead(fileMeta, map, offset, bytes);
+
+	//Only the clusters covering [offset, offset + bytes) are touched, the extent map takes us straight to the first one
+	uint64_t end = offset + bytes;
+	uint64_t first = offset / ClusterSize;
+	uint64_t last = (end - 1) / ClusterSize;
+
+	std::vector<BlockIO>& requests = readRequests;
+	requests.clear();
 
-	uint64_t bytes_so_far = 0;
 	uint8_t* buff = (uint8_t*)buffer;
-	for (uint32_t i = 0; i < chain.size(); i++)
+	for (uint64_t i = first; i <= last; i++)
 	{
-		uint32_t clus = chain[i];
-
-		if (bytes_so_far < offset)
+		uint32_t clus = (uint32_t)map.Lookup(i);
+		if (clus == 0)
 		{
-			bytes_so_far += ClusterSize;
-			continue;
+			return -1;
 		}
 
-		uint64_t toRead = (bytes + offset) - bytes_so_far;
-		if (toRead > ClusterSize)
+		uint64_t clusterStart = i * ClusterSize;
+		uint64_t from = (offset > clusterStart) ? (offset - clusterStart) : 0;
+		uint64_t to = (end < clusterStart + ClusterSize) ? (end - clusterStart) : ClusterSize;
+
+		if (from != 0)
 		{
-			toRead = ClusterSize;
-			ReadCluster(clus, buff);
+			//Only the first cluster can start in the middle, the part before the offset is skipped and the rest is read in place
+			IOSegment head[] = { { nullptr, from }, { buff, to - from } };
+			if (cache->ReadVector(device, GetClusterOffset(clus), head, 2, ClusterSize) != 0)
+			{
+				return -1;
+			}
 		}
 		else
 		{
-			uint8_t* temporary = new uint8_t[ClusterSize];
-			ReadCluster(clus, temporary);
-			memcpy(buff, temporary, toRead);
-			delete[] temporary;
+			//The rest are read straight into the buffer in one batch, the last one only partially
+			//Clusters that follow each other both on the disk and in the buffer are merged into a single request
+			uint64_t physical = GetClusterOffset(clus);
+			BlockIO* previous = (requests.size() > 0) ? &requests.back() : nullptr;
+			if (previous && (previous->offset + previous->size) == physical && ((uint8_t*)previous->buffer + previous->size) == buff
+				&& (previous->size % ClusterSize) == 0 && (previous->size + to) <= cache->GetMaxTransfer())
+			{
+				previous->size += to;
+			}
+			else
+			{
+				requests.push_back({ physical, buff, to });
+			}
 		}
 
-		buff += ClusterSize;
-		bytes_so_far += toRead;
+		buff += to - from;
 	}
 
-	return 0;
+	if (requests.size() == 0)
+	{
+		return 0;
+	}
+
+	return cache->ReadBatch(device, requests.data(), (uint32_t)requests.size(), ClusterSize);
 }
 
-int FAT32Driver::WriteFile(DirEntry fileMeta, uint64_t offset, void* buffer, uint64_t bytes)
+int FAT32Driver::WriteFile(const DirEntry& fileMeta, uint64_t offset, void* buffer, uint64_t bytes)
 {
 	if ((fileMeta.attributes & FILE_DIRECTORY) == FILE_DIRECTORY)
 	{
 		return -3;
 	}
 
-	if ((bytes + offset) > fileMeta.size)
+	DirEntry modified = fileMeta;
+	if ((bytes + offset) > modified.size)
 	{
-		fileMeta.size = bytes + offset;
+		modified.size = bytes + offset;
 
-		uint32_t new_cluster_size = fileMeta.size / ClusterSize;
-		if ((new_cluster_size * ClusterSize) != fileMeta.size)
+		uint32_t new_cluster_size = modified.size / ClusterSize;
+		if ((new_cluster_size * ClusterSize) != modified.size)
 		{
 			new_cluster_size++;
 		}
@@ -761,61 +1179,168 @@ int FAT32Driver::WriteFile(DirEntry fileMeta, uint64_t offset, void* buffer, uin
 		ResizeClusterChain(fileMeta.cluster, new_cluster_size);
 	}
 
-	std::vector<uint32_t> chain = GetClusterChain(fileMeta.cluster);
+	const ExtentMap& map = GetExtentMap(fileMeta.cluster);
+
+	//A write starting past the end of the file leaves a gap, it has to read back as zeros and not as whatever the clusters held before
+	if (offset > fileMeta.size && ClearFileRange(map, fileMeta.size, offset) != 0)
+	{
+		return -1;
+	}
+
+	//Only the clusters covering [offset, offset + bytes) are touched, the extent map takes us straight to the first one
+	uint64_t end = offset + bytes;
+	uint64_t first = offset / ClusterSize;
+	uint64_t last = (bytes == 0) ? 0 : (end - 1) / ClusterSize;
 
-	uint64_t bytes_so_far = 0;
 	uint8_t* buff = (uint8_t*)buffer;
-	for (uint32_t i = 0; i < chain.size(); i++)
+	for (uint64_t i = first; bytes && i <= last; i++)
 	{
-		uint32_t clus = chain[i];
+		uint32_t clus = (uint32_t)map.Lookup(i);
+		if (clus == 0)
+		{
+			return -1;
+		}
+
+		uint64_t clusterStart = i * ClusterSize;
+		uint64_t from = (offset > clusterStart) ? (offset - clusterStart) : 0;
+		uint64_t to = (end < clusterStart + ClusterSize) ? (end - clusterStart) : ClusterSize;
 
-		if (bytes_so_far < offset)
+		if (from == 0 && to == ClusterSize)
 		{
-			bytes_so_far += ClusterSize;
+			//Whole clusters are written together with the ones following them on the disk
+			uint64_t contiguous = 0;
+			map.Lookup(i, &contiguous);
+
+			uint64_t count = (end - clusterStart) / ClusterSize;
+			if (count > contiguous)
+			{
+				count = contiguous;
+			}
+
+			if (WriteClusterRun(clus, (uint32_t)count, buff) != 0)
+			{
+				return -1;
+			}
+
+			i += count - 1;
+			buff += count * ClusterSize;
 			continue;
 		}
-
-		uint64_t toWrite = (bytes + offset) - bytes_so_far;
-		if (toWrite > ClusterSize)
+		else if (!writeBack)
 		{
-			toWrite = ClusterSize;
-			WriteCluster(clus, buff);
+			//Partially written clusters are written in place, the bytes outside the written range are skipped
+			//Only the part past the end of the file is cleared
+			uint64_t fileEnd = modified.size - clusterStart;
+			if (fileEnd > ClusterSize)
+			{
+				fileEnd = ClusterSize;
+			}
+
+			ScratchBuffer temporaryBuffer(*scratch);
+			IOSegment segments[4];
+			uint32_t count = 0;
+			segments[count++] = { nullptr, from };
+			segments[count++] = { buff, to - from };
+			if (fileEnd > to)
+			{
+				segments[count++] = { nullptr, fileEnd - to };
+			}
+
+			if (fileEnd < ClusterSize)
+			{
+				memset(temporaryBuffer, 0, ClusterSize - fileEnd);
+				segments[count++] = { temporaryBuffer, ClusterSize - fileEnd };
+			}
+
+			if (cache->WriteVector(device, GetClusterOffset(clus), segments, count, ClusterSize) != 0)
+			{
+				return -1;
+			}
 		}
 		else
 		{
-			uint8_t* temporary = new uint8_t[ClusterSize];
-			memset(temporary, 0, ClusterSize);
-			memcpy(temporary, buff, toWrite);
-			WriteCluster(clus, temporary);
-			delete[] temporary;
+			//In write-back mode the whole cluster has to be in the cache, it keeps whatever it had outside the written range
+			//The part past the end of the file is cleared
+			ScratchBuffer temporaryBuffer(*scratch);
+			uint8_t* data = GetCluster(clus, temporaryBuffer);
+			memcpy(data + from, buff, to - from);
+
+			if (clusterStart + ClusterSize > modified.size)
+			{
+				uint64_t fileEnd = modified.size - clusterStart;
+				memset(data + fileEnd, 0, ClusterSize - fileEnd);
+			}
+
+			if (WriteCluster(clus, data, BlockKind::Data) != 0)
+			{
+				return -1;
+			}
+		}
+
+		buff += to - from;
+	}
+
+	ModifyDirectoryEntry(fileMeta.parentCluster, fileMeta.name, modified);
+
+	SyncIfNeeded();
+	return 0;
+}
+
+int FAT32Driver::ClearFileRange(const ExtentMap& map, uint64_t from, uint64_t to)
+{
+	ScratchBuffer temporaryBuffer(*scratch);
+
+	for (uint64_t i = from / ClusterSize; from < to; i++)
+	{
+		uint32_t clus = (uint32_t)map.Lookup(i);
+		if (clus == 0)
+		{
+			return -1;
+		}
+
+		uint64_t clusterStart = i * ClusterSize;
+		uint64_t start = from - clusterStart;
+		uint64_t stop = (to < clusterStart + ClusterSize) ? (to - clusterStart) : ClusterSize;
+
+		//Whole clusters are simply overwritten, the rest of a partial one is kept
+		uint8_t* data = temporaryBuffer;
+		if (start != 0 || stop != ClusterSize)
+		{
+			data = GetCluster(clus, temporaryBuffer);
+		}
+
+		memset(data + start, 0, stop - start);
+		if (WriteCluster(clus, data, BlockKind::Data) != 0)
+		{
+			return -1;
 		}
 
-		buff += ClusterSize;
-		bytes_so_far += toWrite;
+		from = clusterStart + stop;
 	}
 
-	ModifyDirectoryEntry(fileMeta.parentCluster, fileMeta.name, fileMeta);
 	return 0;
 }
 
-int FAT32Driver::ResizeFile(DirEntry fileMeta, uint32_t new_size)
+int FAT32Driver::ResizeFile(const DirEntry& fileMeta, uint32_t new_size)
 {
 	if ((fileMeta.attributes & FILE_DIRECTORY) == FILE_DIRECTORY)
 	{
 		return -3;
 	}
 
-	fileMeta.size = new_size;
+	DirEntry modified = fileMeta;
+	modified.size = new_size;
 
-	uint32_t new_cluster_size = fileMeta.size / ClusterSize;
-	if ((new_cluster_size * ClusterSize) != fileMeta.size)
+	uint32_t new_cluster_size = modified.size / ClusterSize;
+	if ((new_cluster_size * ClusterSize) != modified.size)
 	{
 		new_cluster_size++;
 	}
 
 	ResizeClusterChain(fileMeta.cluster, new_cluster_size);
-	ModifyDirectoryEntry(fileMeta.parentCluster, fileMeta.name, fileMeta);
+	ModifyDirectoryEntry(fileMeta.parentCluster, fileMeta.name, modified);
 
+	SyncIfNeeded();
 	return 0;
 }
 
@@ -870,7 +1395,7 @@ DirEntry FAT32Driver::FromFATEntry(DirectoryEntry* entry, bool long_fname)
 {
 	DirEntry ent;
 
-	if (long_fname && (((LongDirectoryEntry*)(entry - 1))->attributes & FILE_LONG_NAME))
+	if (long_fname && ((((LongDirectoryEntry*)(entry - 1))->attributes & FILE_LONG_NAME) == FILE_LONG_NAME))
 	{
 		char long_name[255];
 		uint32_t count = 0;
@@ -927,9 +1452,13 @@ DirEntry FAT32Driver::FromFATEntry(DirectoryEntry* entry, bool long_fname)
 	return ent;
 }
 
-DirectoryEntry* FAT32Driver::ToFATEntry(DirEntry entry, uint32_t& longEntries)
+DirectoryEntry* FAT32Driver::ToFATEntry(const DirEntry& entry, uint32_t& longEntries)
 {
-	char* namePtr = entry.name;
+	//ConvertToFATFormat works in place
+	char name[sizeof(entry.name)];
+	strcpy(name, entry.name);
+
+	char* namePtr = name;
 	size_t nameLen = strlen(namePtr);
 	if (nameLen <= 12)
 	{
@@ -1103,7 +1632,7 @@ uint16_t FAT32Driver::GetDate()
 	return day | (mon << 5) | ((year - 1980) << 9);
 }
 
-int FAT32Driver::IsFATFormat(char* name)
+int FAT32Driver::IsFATFormat(const char* name)
 {
 	size_t len = strlen(name);
 	if (len != 11)
@@ -1363,7 +1892,7 @@ int FAT32Driver::InitialiseFAT32(FAT32_Data data)
 	memset(fsInfo, 0, 512);
 	fsInfo->LeadSignature = 0x41615252;
 	fsInfo->StructSignature = 0x61417272;
-	fsInfo->FreeSpace = NumberOfClusters - 1; //We're gonna overwrite this soon so no point storing
+	fsInfo->FreeSpace = (data.TotalSectors - FirstDataSector) / data.SectorsPerCluster - 1; //Every data cluster but the root directory's
 	fsInfo->LastWritten = 2;
 	fsInfo->TrailSignature = 0xAA550000;
 
@@ -2,8 +2,19 @@
 #define FAT32_DRIVER_H
 
 #include "FAT32defs.h"
-
+#include "BlockDevice.h"
+#include "BufferCache.h"
+#include "FATCache.h"
+#include "ExtentMap.h"
+#include "ClusterAllocator.h"
+#include "ScratchPool.h"
+#include "Readahead.h"
+#include "DirectoryIndex.h"
+#include "DentryCache.h"
+
+#include <functional>
 #include <map>
+#include <unordered_map>
 #include <vector>
 
 const char BootCode[] = { 0xFA, 0x31, 0xC0, 0x8E, 0xD0, 0x89, 0xC4, 0x8E, 0xD8, 0x8E,
@@ -74,31 +85,48 @@ struct FAT32_Data
 class FAT32Driver
 {
 public:
-	FAT32Driver(const std::string& image);
+	FAT32Driver(const std::string& image, BlockDeviceType type = BlockDeviceType::File);
 	~FAT32Driver();
 
+	//False if the image couldn't be opened, nothing else may be called then
+	bool IsOpen() const { return device != nullptr; }
+
 	//if exclude is true, we only give back entries with filter_attributes as their attributes
 	//otherwise, we ignore entries that have filter_attributes set
 	std::vector<DirEntry> GetDirectories(uint32_t cluster, uint32_t filter_attributes, bool exclude);
 
-	void ModifyDirectoryEntry(uint32_t cluster, const char* name, DirEntry modified);
+	//Calls callback with every entry of the directory, in order, decoding them one at a time
+	//Returning false from callback stops the walk, the callback mustn't modify the directory
+	void ForEachEntry(uint32_t cluster, const std::function<bool(const DirEntry&)>& callback);
+
+	void ModifyDirectoryEntry(uint32_t cluster, const char* name, const DirEntry& modified);
 
 	int PrepareAddedDirectory(uint32_t cluster);
-	void CleanFileEntry(uint32_t cluster, DirEntry entry);
+	void CleanFileEntry(uint32_t cluster, const DirEntry& entry);
 	
 	int DirectorySearch(const char* FilePart, uint32_t cluster, DirEntry* file);
-	int DirectoryAdd(uint32_t cluster, DirEntry file);
+	int DirectoryAdd(uint32_t cluster, const DirEntry& file);
 
 	int OpenFile(const char* filePath, DirEntry* fileMeta);
 	int CreateFile(const char* filePath, DirEntry* fileMeta);
-	int DeleteFile(DirEntry fileMeta);
+	int DeleteFile(const DirEntry& fileMeta);
 
-	int ReadFile(DirEntry fileMeta, uint64_t offset, void* buffer, uint64_t bytes);
-	int WriteFile(DirEntry fileMeta, uint64_t offset, void* buffer, uint64_t bytes);
-	int ResizeFile(DirEntry fileMeta, uint32_t new_size);
+	int ReadFile(const DirEntry& fileMeta, uint64_t offset, void* buffer, uint64_t bytes);
+	int WriteFile(const DirEntry& fileMeta, uint64_t offset, void* buffer, uint64_t bytes);
+	int ResizeFile(const DirEntry& fileMeta, uint32_t new_size);
 
 	uint32_t GetRootDirStart() const { return RootDirStart; }
 
+	//Kept up to date in the FSInfo sector, only counted from the FAT if FSInfo didn't have a valid count
+	uint32_t GetFreeClusters();
+
+	//Writes everything that's been buffered: the file data, then the FAT, then the directory entries
+	int Sync();
+
+	//With write-back on (the default), cluster and FAT writes are only buffered until Sync, the dirty threshold or closing
+	void SetWriteBack(bool enabled);
+	bool GetWriteBack() const { return writeBack; }
+
 public:
 	static int InitialiseFAT32(FAT32_Data data);
 	static FAT32Driver* CreateFAT32(FAT32_Data data);
@@ -108,11 +136,35 @@ private:
 	uint32_t WriteFAT(uint32_t cluster, uint32_t value);
 
 	uint32_t ReadCluster(uint32_t cluster, void* buffer);
-	uint32_t WriteCluster(uint32_t cluster, void* buffer);
+	uint32_t WriteCluster(uint32_t cluster, void* buffer, BlockKind kind = BlockKind::Metadata);
+	//Writes count physically consecutive clusters of file data, with as few device writes as the transfer limit allows
+	uint32_t WriteClusterRun(uint32_t cluster, uint32_t count, void* buffer);
+
+	//Returns the cluster's data, pointing straight into the image if it's memory mapped, otherwise it's read into buffer
+	uint8_t* GetCluster(uint32_t cluster, void* buffer);
+	uint64_t GetClusterOffset(uint32_t cluster);
 
 	std::vector<uint32_t> GetClusterChain(uint32_t start);
 
-	uint32_t AllocateClusterChain(uint32_t size);
+	//The chain starting at start as extents, it's only walked the first time, until the chain is resized or freed
+	const ExtentMap& GetExtentMap(uint32_t start);
+	void InvalidateExtentMap(uint32_t start);
+
+	//Zeroes the bytes [from, to) of the file mapped by map, its clusters have to be allocated already
+	int ClearFileRange(const ExtentMap& map, uint64_t from, uint64_t to);
+
+	//Links a new, cleared cluster after the last cluster of a directory, returns BAD_CLUSTER if the disk is full
+	uint32_t GrowDirectory(uint32_t cluster);
+
+	//Adds the entry DirectoryAdd just wrote at offset in cluster to its directory's index
+	//isLFN tells whether long entries were written in front of it, a name that fits a short entry has none
+	void IndexAddedEntry(uint32_t cluster, DirectoryEntry* entry, bool isLFN, uint32_t offset);
+
+	//Prefetches the clusters ahead of a read of the file, if its reads have been sequential so far
+	void ReadAhead(const DirEntry& fileMeta, const ExtentMap& map, uint64_t offset, uint64_t bytes);
+
+	//If hint is free the chain starts there, so a chain being extended can continue where it ends
+	uint32_t AllocateClusterChain(uint32_t size, uint32_t hint = 0);
 	void FreeClusterChain(uint32_t start);
 
 	void* ReadClusterChain(uint32_t start, uint32_t& size);
@@ -120,17 +172,22 @@ private:
 	void ResizeClusterChain(uint32_t start, uint32_t new_size);
 
 	void GetDirectoriesOnCluster(uint32_t cluster, std::vector<DirEntry>& entries);
+
+	//The free space index is built from the FAT the first time something is allocated
+	ClusterAllocator* GetAllocator();
+
+	void SyncIfNeeded();
 	
 private:
 	uint32_t GetClusterFromFilePath(const char* filePath, DirEntry* entry);
 
 	DirEntry FromFATEntry(DirectoryEntry* entry, bool long_fname);
-	DirectoryEntry* ToFATEntry(DirEntry entry, uint32_t& longEntries);
+	DirectoryEntry* ToFATEntry(const DirEntry& entry, uint32_t& longEntries);
 
 	bool Compare(DirectoryEntry* entry, const char* name, bool long_name);
 
 	void ConvertFromFATFormat(char* input, char* output);
-	int IsFATFormat(char* name);
+	int IsFATFormat(const char* name);
 	char* ConvertToFATFormat(char* input);
 
 	static uint8_t GetMilliseconds();
@@ -138,13 +195,37 @@ private:
 	static uint16_t GetDate();
 
 private:
-	std::fstream file;
+	BlockDevice* device = nullptr;
+	BufferCache* cache;
+
+	//Cluster sized buffers for partial cluster I/O and directory updates
+	ScratchPool* scratch = nullptr;
+	FATCache* FATcache = nullptr;
+
+	//Extent maps of the files accessed, keyed by their first cluster
+	std::unordered_map<uint32_t, ExtentMap> extentMaps;
+	static const uint32_t MaxExtentMaps = 256;
+
+	//Sequential read detection, keyed by the files' first cluster
+	Readahead readahead;
 
-	uint8_t* temporaryBuffer;
-	uint8_t* temporaryBuffer2;
-	uint8_t* FATcache;
+	//The device requests of a ReadFile, kept so it only allocates while the reads keep getting bigger
+	std::vector<BlockIO> readRequests;
 
-	FAT32_BootSector* BootSector;
+	//Entries of the directories searched, keyed by the directories' first cluster
+	DirectoryIndex<DirEntry> directoryIndex;
+
+	//Path components resolved lately (and the ones that weren't found), keyed by the directory's first cluster
+	DentryCache<DirEntry> dentries;
+	ClusterAllocator* allocator = nullptr;
+
+	FSInfo* FileSystemInfo = nullptr;
+	bool FSInfoValid = false;
+	bool FSInfoDirty = false;
+
+	bool writeBack = true;
+
+	FAT32_BootSector* BootSector = nullptr;
 
 	uint32_t FirstDataSector;
 	uint32_t RootDirStart;
@@ -153,6 +234,9 @@ private:
 
 	uint32_t TotalSectors;
 	uint32_t TotalClusters;
+
+	//Clusters in the data region that also have a FAT entry, these are the ones that can be allocated
+	uint32_t DataClusters;
 };
 
 #endif
\ No newline at end of file
@@ -33,7 +33,7 @@ int main()
 
 	FAT32 fat32("../FAT32/res/HackOS.img");
 	FAT32_FolderStructure* root = fat32.GetRoot();
-	FAT32Driver* driver = fat32.GetDriver();
+	FAT32_DriverHandle driver = fat32.GetDriver();
 
 	FAT32_Data data;
 	data.name = "test";
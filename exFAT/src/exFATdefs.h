@@ -32,6 +32,8 @@
 #define ENTRY_STREAM 0xC0
 #define ENTRY_FILENAME 0xC1
 
+#define STREAM_NO_FAT_CHAIN 0x2
+
 namespace exFAT
 {
 	PACK(struct exFAT_BootSector
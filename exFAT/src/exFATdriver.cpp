@@ -2,17 +2,19 @@
 
 namespace exFAT
 {
-	exFATDriver::exFATDriver(const std::string& image)
+	exFATDriver::exFATDriver(const std::string& image, BlockDeviceType type)
 	{
-		file.open(image, std::ios::in | std::ios::out | std::ios::binary);
+		device = BlockDevice::Open(image, type);
+		cache = &BufferCache::Shared();
 
-		if (!file.is_open())
+		if (device == nullptr)
 		{
 			std::cerr << "ERROR: " << image << " could not be opened!\n";
+			return;
 		}
 
 		BootSector = new exFAT_BootSector();
-		file.read((char*)BootSector, sizeof(exFAT_BootSector));
+		device->Read(0, BootSector, sizeof(exFAT_BootSector));
 
 		SectorSize = (1 << BootSector->SectorShift);
 		SectorsPerCluster = (1 << BootSector->ClusterShift);
@@ -21,41 +23,29 @@ namespace exFAT
 		TotalSectors = BootSector->VolumeLength;
 		TotalClusters = TotalSectors / SectorsPerCluster;
 
-		temporaryBuffer = new uint8_t[ClusterSize];
-		temporaryBuffer2 = new uint8_t[ClusterSize];
-
-		FATcache = new uint8_t[BootSector->FATLength * SectorSize];
+		scratch = new ScratchPool(ClusterSize);
 
+		uint32_t activeFAT = 0;
 		if (((BootSector->Flags & EX_FAT_USE_SECOND_FAT) == EX_FAT_USE_SECOND_FAT) && (BootSector->NumberOfFATs == 2))
 		{
-			file.seekg((BootSector->FATOffset + BootSector->FATLength) * SectorSize);
-			file.read((char*)FATcache, BootSector->FATLength * SectorSize);
-		}
-		else
-		{
-			file.seekg(BootSector->FATOffset * SectorSize);
-			file.read((char*)FATcache, BootSector->FATLength * SectorSize);
+			activeFAT = 1;
 		}
 
+		FATcache = new FATCache(device, (uint64_t)BootSector->FATOffset * SectorSize, (uint64_t)BootSector->FATLength * SectorSize, SectorSize, BootSector->NumberOfFATs, activeFAT);
+
 		std::vector<DirEntry> root;
 		GetDirectoriesOnCluster(BootSector->RootDirectoryCluster, root); //This will initialise the allocation bitmap which is under root
 	}
 
 	exFATDriver::~exFATDriver()
 	{
-		file.seekg(0);
-		file.write((const char*)BootSector, 512);
-
-		file.seekg(BootSector->FATOffset * SectorSize);
-		file.write((const char*)FATcache, BootSector->FATLength * SectorSize);
-
-		//copy the first FAT onto the other ones upon closing the FS
-		for (uint32_t i = 1; i < BootSector->NumberOfFATs; i++)
+		if (device == nullptr)
 		{
-			file.seekg((BootSector->FATOffset + BootSector->FATLength) * SectorSize);
-			file.write((const char*)FATcache, BootSector->FATLength * SectorSize);
+			return;
 		}
 
+		device->Write(0, BootSector, 512);
+
 		if (bitmapEntry1)
 		{
 			WriteClusterChain(bitmapEntry1->Cluster, AllocationBitmap.buffer, bitmapEntry1->Size);
@@ -66,16 +56,19 @@ namespace exFAT
 			WriteClusterChain(bitmapEntry2->Cluster, AllocationBitmap.buffer, bitmapEntry2->Size);
 		}
 
+		Sync();
+
 		if (AllocationBitmap.buffer)
 		{
 			delete[] AllocationBitmap.buffer;
 		}
 
-		delete[] FATcache;
-		delete[] temporaryBuffer;
-		delete[] temporaryBuffer2;
+		delete FATcache;
+		delete scratch;
 
 		delete BootSector;
+		cache->Invalidate(device);
+		delete device;
 	}
 
 	uint32_t exFATDriver::ReadFAT(uint32_t cluster)
@@ -85,8 +78,7 @@ namespace exFAT
 			return -1;
 		}
 
-		uint32_t* FATtable = (uint32_t*)FATcache;
-		return FATtable[cluster];
+		return FATcache->Get(cluster);
 	}
 
 	uint32_t exFATDriver::WriteFAT(uint32_t cluster, uint32_t value)
@@ -96,11 +88,58 @@ namespace exFAT
 			return -1;
 		}
 
-		uint32_t* FATtable = (uint32_t*)FATcache;
-		FATtable[cluster] = value;
+		FATcache->Set(cluster, value);
 		return 0;
 	}
 
+	int exFATDriver::Sync()
+	{
+		//Data first, then the FAT linking it, then the directory entries pointing at the chains
+		int ret = cache->Sync(device, BlockKind::Data);
+
+		//Only the modified FAT sectors are written, to every copy of the FAT
+		if (FATcache->Flush() != 0)
+		{
+			ret = -1;
+		}
+
+		if (cache->Sync(device, BlockKind::Metadata) != 0)
+		{
+			ret = -1;
+		}
+
+		if (device->Flush() != 0)
+		{
+			ret = -1;
+		}
+
+		return ret;
+	}
+
+	void exFATDriver::SetWriteBack(bool enabled)
+	{
+		if (writeBack && !enabled)
+		{
+			Sync();
+		}
+
+		writeBack = enabled;
+	}
+
+	void exFATDriver::SyncIfNeeded()
+	{
+		if (writeBack && cache->NeedsSync(device))
+		{
+			Sync();
+		}
+	}
+
+	uint64_t exFATDriver::GetClusterOffset(uint32_t cluster)
+	{
+		uint64_t start_sector = (uint64_t)(cluster - 2) * SectorsPerCluster + BootSector->ClusterHeapOffset;
+		return start_sector * SectorSize;
+	}
+
 	uint32_t exFATDriver::ReadCluster(uint32_t cluster, void* buffer)
 	{
 		if (cluster < 2 || cluster > TotalClusters)
@@ -108,25 +147,86 @@ namespace exFAT
 			return -1;
 		}
 
-		uint32_t start_sector = (cluster - 2) * SectorsPerCluster + BootSector->ClusterHeapOffset;
-		file.seekg(start_sector * SectorSize);
-		file.read((char*)buffer, ClusterSize);
-		return 0;
+		return cache->Read(device, GetClusterOffset(cluster), buffer, ClusterSize);
 	}
 
-	uint32_t exFATDriver::WriteCluster(uint32_t cluster, void* buffer)
+	uint32_t exFATDriver::WriteCluster(uint32_t cluster, void* buffer, BlockKind kind)
 	{
 		if (cluster < 2 || cluster > TotalClusters)
 		{
 			return -1;
 		}
 
-		uint32_t start_sector = (cluster - 2) * SectorsPerCluster + BootSector->ClusterHeapOffset;
-		file.seekg(start_sector * SectorSize);
-		file.write((char*)buffer, ClusterSize);
+		if (writeBack)
+		{
+			return cache->WriteBack(device, GetClusterOffset(cluster), buffer, ClusterSize, kind);
+		}
+
+		return cache->Write(device, GetClusterOffset(cluster), buffer, ClusterSize);
+	}
+
+	uint32_t exFATDriver::WriteClusterRun(uint32_t cluster, uint32_t count, void* buffer)
+	{
+		if (cluster < 2 || count == 0 || (cluster + count - 1) > TotalClusters)
+		{
+			return -1;
+		}
+
+		uint8_t* buff = (uint8_t*)buffer;
+
+		//Write-back blocks are merged by Sync anyway, they only have to land in the cache one cluster at a time
+		if (writeBack)
+		{
+			for (uint32_t i = 0; i < count; i++)
+			{
+				if (cache->WriteBack(device, GetClusterOffset(cluster + i), buff + (uint64_t)i * ClusterSize, ClusterSize, BlockKind::Data) != 0)
+				{
+					return -1;
+				}
+			}
+
+			return 0;
+		}
+
+		uint32_t perTransfer = (uint32_t)(cache->GetMaxTransfer() / ClusterSize);
+		if (perTransfer == 0)
+		{
+			perTransfer = 1;
+		}
+
+		while (count)
+		{
+			uint32_t now = (count > perTransfer) ? perTransfer : count;
+			if (cache->WriteRange(device, GetClusterOffset(cluster), buff, (uint64_t)now * ClusterSize, ClusterSize) != 0)
+			{
+				return -1;
+			}
+
+			cluster += now;
+			count -= now;
+			buff += (uint64_t)now * ClusterSize;
+		}
+
 		return 0;
 	}
 
+	uint8_t* exFATDriver::GetCluster(uint32_t cluster, void* buffer)
+	{
+		if (cluster < 2 || cluster > TotalClusters)
+		{
+			return nullptr;
+		}
+
+		uint8_t* mapped = device->Map(GetClusterOffset(cluster), ClusterSize);
+		if (mapped)
+		{
+			return mapped;
+		}
+
+		ReadCluster(cluster, buffer);
+		return (uint8_t*)buffer;
+	}
+
 	std::vector<uint32_t> exFATDriver::GetClusterChain(uint32_t start)
 	{
 		if (start < 2 || start > TotalClusters)
@@ -134,6 +234,21 @@ namespace exFAT
 			return {};
 		}
 
+		//Without a FAT chain the clusters are consecutive, as many as the length needs
+		auto contiguous = contiguousChains.find(start);
+		if (contiguous != contiguousChains.end())
+		{
+			uint64_t count = GetContiguousCount(start, contiguous->second);
+
+			std::vector<uint32_t> clusters;
+			for (uint64_t i = 0; i < count; i++)
+			{
+				clusters.push_back(start + (uint32_t)i);
+			}
+
+			return clusters;
+		}
+
 		std::vector<uint32_t> chain = { start };
 
 		uint32_t current = start;
@@ -158,6 +273,64 @@ namespace exFAT
 		return chain;
 	}
 
+	const ExtentMap& exFATDriver::GetExtentMap(uint32_t start)
+	{
+		auto it = extentMaps.find(start);
+		if (it != extentMaps.end())
+		{
+			return it->second;
+		}
+
+		if (extentMaps.size() >= MaxExtentMaps)
+		{
+			extentMaps.clear();
+		}
+
+		ExtentMap& map = extentMaps[start];
+		if (start < 2 || start > TotalClusters)
+		{
+			return map;
+		}
+
+		auto contiguous = contiguousChains.find(start);
+		if (contiguous != contiguousChains.end())
+		{
+			uint64_t count = GetContiguousCount(start, contiguous->second);
+			for (uint64_t i = 0; i < count; i++)
+			{
+				map.Append(start + (uint32_t)i);
+			}
+
+			return map;
+		}
+
+		uint32_t current = start;
+		while (true)
+		{
+			map.Append(current);
+
+			current = ReadFAT(current);
+			if (current == BAD_CLUSTER || map.GetLength() > TotalClusters)
+			{
+				//Same as GetClusterChain, a broken chain is an empty one
+				map.Clear();
+				break;
+			}
+
+			if (current >= END_CLUSTER)
+			{
+				break;
+			}
+		}
+
+		return map;
+	}
+
+	void exFATDriver::InvalidateExtentMap(uint32_t start)
+	{
+		extentMaps.erase(start);
+	}
+
 	uint32_t exFATDriver::AllocateClusterChain(uint32_t size)
 	{
 		if (size <= 0)
@@ -206,9 +379,68 @@ namespace exFAT
 		return start;
 	}
 
+	void exFATDriver::ReadAhead(const DirEntry& fileMeta, const ExtentMap& map, uint64_t offset, uint64_t bytes)
+	{
+		uint64_t start = 0;
+		uint64_t length = 0;
+		if (!readahead.Access(fileMeta.cluster, offset, bytes, start, length) || start >= fileMeta.size)
+		{
+			return;
+		}
+
+		uint64_t end = start + length;
+		if (end > fileMeta.size)
+		{
+			end = fileMeta.size;
+		}
+
+		//Every physically contiguous run of the window is a single hint
+		uint64_t i = start / ClusterSize;
+		uint64_t last = (end - 1) / ClusterSize;
+		while (i <= last)
+		{
+			uint64_t contiguous = 0;
+			uint32_t clus = (uint32_t)map.Lookup(i, &contiguous);
+			if (clus == 0)
+			{
+				return;
+			}
+
+			uint64_t count = last - i + 1;
+			if (count > contiguous)
+			{
+				count = contiguous;
+			}
+
+			device->Prefetch(GetClusterOffset(clus), count * ClusterSize);
+			i += count;
+		}
+	}
+
+	uint64_t exFATDriver::GetContiguousCount(uint32_t start, uint64_t length)
+	{
+		uint64_t count = (length + ClusterSize - 1) / ClusterSize;
+		if (count == 0)
+		{
+			count = 1;
+		}
+
+		//The length can't take the chain past the end of the cluster heap
+		if (start + count - 1 > TotalClusters)
+		{
+			count = TotalClusters - start + 1;
+		}
+
+		return count;
+	}
+
 	void exFATDriver::FreeClusterChain(uint32_t start)
 	{
+		InvalidateExtentMap(start);
+		readahead.Forget(start);
+
 		std::vector<uint32_t> chain = GetClusterChain(start);
+		contiguousChains.erase(start);
 
 		for (uint32_t i = 0; i < chain.size(); i++)
 		{
@@ -259,6 +491,8 @@ namespace exFAT
 
 	void exFATDriver::ResizeClusterChain(uint32_t start, uint32_t new_size)
 	{
+		InvalidateExtentMap(start);
+
 		std::vector<uint32_t> chain = GetClusterChain(start);
 		uint32_t cur_size = chain.size();
 
@@ -266,7 +500,17 @@ namespace exFAT
 		{
 			return;
 		}
-		else if (cur_size > new_size)
+
+		//A chain without FAT entries gets them first, so it's resized like any other
+		if (contiguousChains.erase(start) != 0)
+		{
+			for (uint32_t i = 0; i < cur_size; i++)
+			{
+				WriteFAT(chain[i], (i + 1 < cur_size) ? chain[i + 1] : END_CLUSTER);
+			}
+		}
+
+		if (cur_size > new_size)
 		{
 			WriteFAT(chain[new_size - 1], END_CLUSTER);
 			FreeClusterChain(chain[new_size]);
@@ -278,16 +522,18 @@ namespace exFAT
 		}
 	}
 
-	void exFATDriver::GetDirectoriesOnCluster(uint32_t cluster, std::vector<DirEntry>& entries)
+	void exFATDriver::ForEachEntry(uint32_t cluster, const std::function<bool(const DirEntry&)>& callback)
 	{
 		if (cluster < 2 || cluster > TotalClusters)
 		{
 			return;
 		}
 
-		ReadCluster(cluster, temporaryBuffer);
+		//One cluster of the directory is held at a time, the entry being decoded may continue in the next one
+		ScratchBuffer temporaryBuffer(*scratch);
+		uint8_t* data = GetCluster(cluster, temporaryBuffer);
 
-		FileEntryGeneral* metadata = (FileEntryGeneral*)temporaryBuffer;
+		FileEntryGeneral* metadata = (FileEntryGeneral*)data;
 		uint32_t meta_pointer_iterator = 0;
 
 		DirEntry nextFile;
@@ -298,6 +544,12 @@ namespace exFAT
 		uint32_t secondaryEntries = 0;
 		uint32_t secondaryEntryCount = 0;
 
+		//Without a FAT chain the directory's FAT entries mean nothing, its length tells where it ends
+		auto contiguous = contiguousChains.find(cluster);
+		bool noFatChain = (contiguous != contiguousChains.end());
+		uint64_t length = noFatChain ? contiguous->second : 0;
+		uint64_t walked = ClusterSize;
+
 		while (true)
 		{
 			if (metadata->EntryType == ENTRY_END)
@@ -331,8 +583,10 @@ namespace exFAT
 							}
 							else
 							{
-								ReadCluster(clus, temporaryBuffer);
-								memcpy(ptr, temporaryBuffer, allocSize);
+								//temporaryBuffer is holding the directory we're walking
+								ScratchBuffer bitmapBuffer(*scratch);
+								uint8_t* bitmapData = GetCluster(clus, bitmapBuffer);
+								memcpy(ptr, bitmapData, allocSize);
 							}
 
 							ptr += ClusterSize;
@@ -363,8 +617,10 @@ namespace exFAT
 							}
 							else
 							{
-								ReadCluster(clus, temporaryBuffer);
-								memcpy(ptr, temporaryBuffer, allocSize);
+								//temporaryBuffer is holding the directory we're walking
+								ScratchBuffer bitmapBuffer(*scratch);
+								uint8_t* bitmapData = GetCluster(clus, bitmapBuffer);
+								memcpy(ptr, bitmapData, allocSize);
 							}
 
 							ptr += ClusterSize;
@@ -403,6 +659,15 @@ namespace exFAT
 				nextFile.size = streamEntry->DataLength;
 				nextFile.cluster = streamEntry->FirstCluster;
 
+				if ((streamEntry->SecondaryFlags & STREAM_NO_FAT_CHAIN) == STREAM_NO_FAT_CHAIN)
+				{
+					contiguousChains[streamEntry->FirstCluster] = streamEntry->DataLength;
+				}
+				else
+				{
+					contiguousChains.erase(streamEntry->FirstCluster);
+				}
+
 				secondaryEntries++;
 			}
 			else if (metadata->EntryType == ENTRY_FILENAME)
@@ -420,16 +685,58 @@ namespace exFAT
 
 				if (secondaryEntries == secondaryEntryCount)
 				{
-					entries.push_back(nextFile);
+					if (!callback(nextFile))
+					{
+						break;
+					}
+
 					memset(&nextFile, 0, sizeof(DirEntry));
 				}
 			}
 
-			metadata++;
-			meta_pointer_iterator++;
+			if (meta_pointer_iterator < ClusterSize / sizeof(FileEntryGeneral) - 1)
+			{
+				metadata++;
+				meta_pointer_iterator++;
+			}
+			else
+			{
+				if (noFatChain)
+				{
+					if (walked >= length)
+					{
+						break;
+					}
+
+					cluster++;
+					walked += ClusterSize;
+				}
+				else
+				{
+					cluster = ReadFAT(cluster);
+				}
+
+				if (cluster < 2 || cluster > TotalClusters)
+				{
+					break;
+				}
+
+				data = GetCluster(cluster, temporaryBuffer);
+				metadata = (FileEntryGeneral*)data;
+				meta_pointer_iterator = 0;
+			}
 		}
 	}
 
+	void exFATDriver::GetDirectoriesOnCluster(uint32_t cluster, std::vector<DirEntry>& entries)
+	{
+		ForEachEntry(cluster, [&](const DirEntry& entry)
+		{
+			entries.push_back(entry);
+			return true;
+		});
+	}
+
 	uint32_t exFATDriver::GetClusterFromFilePath(const char* filePath, DirEntry* entry)
 	{
 		char fileNamePart[256];
@@ -517,42 +824,35 @@ namespace exFAT
 			return ret;
 		}
 
-		std::vector<DirEntry> all;
-		GetDirectoriesOnCluster(cluster, all);
-
-		for (auto elem : all)
+		//Only the entries that pass the filter are kept
+		ForEachEntry(cluster, [&](const DirEntry& elem)
 		{
-			if (!exclude)
+			if (((elem.attributes & filter_attributes) != 0) == exclude)
 			{
-				if (elem.attributes & filter_attributes)
-				{
-					continue;
-				}
-
 				ret.push_back(elem);
 			}
-			else
-			{
-				if (elem.attributes & filter_attributes)
-				{
-					ret.push_back(elem);
-				}
-			}
-		}
+
+			return true;
+		});
 
 		return ret;
 	}
 
-	void exFATDriver::ModifyDirectoryEntry(uint32_t cluster, const char* name, DirEntry modified)
+	void exFATDriver::ModifyDirectoryEntry(uint32_t cluster, const char* name, const DirEntry& modified)
 	{
 		if (cluster < 2 || cluster > TotalClusters)
 		{
 			return;
 		}
 
-		ReadCluster(cluster, temporaryBuffer);
+		//Entries aren't updated in place yet, the directory is decoded again on its next search
+		directoryIndex.Invalidate(directoryIndex.GetDirectory(cluster));
+		dentries.RemoveAt(cluster, name);
+
+		ScratchBuffer temporaryBuffer(*scratch);
+		uint8_t* data = GetCluster(cluster, temporaryBuffer);
 
-		FileEntryGeneral* metadata = (FileEntryGeneral*)temporaryBuffer;
+		FileEntryGeneral* metadata = (FileEntryGeneral*)data;
 		uint32_t meta_pointer_iterator = 0;
 
 		DirEntry nextFile;
@@ -623,7 +923,7 @@ namespace exFAT
 
 				if (secondaryEntries == secondaryEntryCount)
 				{
-					WriteCluster(cluster, temporaryBuffer);
+					WriteCluster(cluster, data);
 					break;
 				}
 			}
@@ -702,10 +1002,11 @@ namespace exFAT
 		return 0;
 	}
 
-	void exFATDriver::CleanFileEntry(uint32_t cluster, DirEntry entry)
+	void exFATDriver::CleanFileEntry(uint32_t cluster, const DirEntry& entry)
 	{
-		entry.attributes = 0;
-		ModifyDirectoryEntry(cluster, entry.name, entry);
+		DirEntry cleaned = entry;
+		cleaned.attributes = 0;
+		ModifyDirectoryEntry(cluster, entry.name, cleaned);
 	}
 
 	int exFATDriver::DirectorySearch(const char* FilePart, uint32_t cluster, DirEntry* file)
@@ -715,26 +1016,38 @@ namespace exFAT
 			return -1;
 		}
 
-		std::vector<DirEntry> entries;
-		GetDirectoriesOnCluster(cluster, entries);
+		DentryCache<DirEntry>::Result cached = dentries.Lookup(cluster, FilePart, file);
+		if (cached != DentryCache<DirEntry>::Result::Unknown)
+		{
+			return (cached == DentryCache<DirEntry>::Result::Found) ? 0 : -2;
+		}
+
+		//The directory is only decoded the first time, after that every lookup is a hash lookup
+		if (!directoryIndex.IsIndexed(cluster))
+		{
+			std::vector<DirEntry> entries;
+			GetDirectoriesOnCluster(cluster, entries);
+			directoryIndex.Build(cluster, entries, GetClusterChain(cluster));
+		}
 
-		for (auto entry : entries)
+		DirEntry* entry = directoryIndex.Find(cluster, FilePart);
+		if (entry == nullptr)
 		{
-			if (strcmp(entry.name, FilePart) == 0)
-			{
-				if (file != nullptr)
-				{
-					*file = entry;
-				}
+			dentries.InsertNegative(cluster, FilePart);
+			return -2;
+		}
 
-				return 0;
-			}
+		dentries.Insert(cluster, FilePart, *entry, entry->parentCluster);
+
+		if (file != nullptr)
+		{
+			*file = *entry;
 		}
 
-		return -2;
+		return 0;
 	}
 
-	int exFATDriver::DirectoryAdd(uint32_t cluster, DirEntry file)
+	int exFATDriver::DirectoryAdd(uint32_t cluster, const DirEntry& file)
 	{
 		return 0;
 	}
@@ -776,15 +1089,17 @@ namespace exFAT
 		}
 
 		retVal = DirectoryAdd(active_cluster, *fileMeta);
+		dentries.Remove(active_cluster, fileMeta->name);
 		if (retVal != 0)
 		{
 			return -1;
 		}
 
+		SyncIfNeeded();
 		return DirectorySearch(fileMeta->name, active_cluster, fileMeta);
 	}
 
-	int exFATDriver::DeleteFile(DirEntry entry)
+	int exFATDriver::DeleteFile(const DirEntry& entry)
 	{
 		if ((entry.attributes & FILE_DIRECTORY) == FILE_DIRECTORY)
 		{
@@ -794,74 +1109,117 @@ namespace exFAT
 			{
 				DeleteFile(dir);
 			}
+
+			directoryIndex.Invalidate(entry.cluster);
+			dentries.RemoveDirectory(entry.cluster);
 		}
 
 		FreeClusterChain(entry.cluster);
 		CleanFileEntry(entry.parentCluster, entry);
 
+		SyncIfNeeded();
 		return 0;
 	}
 
-	int exFATDriver::ReadFile(DirEntry fileMeta, uint64_t offset, void* buffer, uint64_t bytes)
+	int exFATDriver::ReadFile(const DirEntry& fileMeta, uint64_t offset, void* buffer, uint64_t bytes)
 	{
 		if ((fileMeta.attributes & FILE_DIRECTORY) == FILE_DIRECTORY)
 		{
 			return -3;
 		}
 
+		if (offset >= fileMeta.size)
+		{
+			return 0;
+		}
+
 		if ((bytes + offset) > fileMeta.size)
 		{
 			bytes = fileMeta.size - offset;
 		}
 
-		std::vector<uint32_t> chain = GetClusterChain(fileMeta.cluster);
+		if (bytes == 0)
+		{
+			return 0;
+		}
+
+		const ExtentMap& map = GetExtentMap(fileMeta.cluster);
+
+		//The window after this read is requested first, the device loads it while this read is served and consumed
+		ReadAhead(fileMeta, map, offset, bytes);
+
+		//Only the clusters covering [offset, offset + bytes) are touched, the extent map takes us straight to the first one
+		uint64_t end = offset + bytes;
+		uint64_t first = offset / ClusterSize;
+		uint64_t last = (end - 1) / ClusterSize;
+
+		std::vector<BlockIO>& requests = readRequests;
+		requests.clear();
 
-		uint64_t bytes_so_far = 0;
 		uint8_t* buff = (uint8_t*)buffer;
-		for (uint32_t i = 0; i < chain.size(); i++)
+		for (uint64_t i = first; i <= last; i++)
 		{
-			uint32_t clus = chain[i];
-
-			if (bytes_so_far < offset)
+			uint32_t clus = (uint32_t)map.Lookup(i);
+			if (clus == 0)
 			{
-				bytes_so_far += ClusterSize;
-				continue;
+				return -1;
 			}
 
-			uint64_t toRead = (bytes + offset) - bytes_so_far;
-			if (toRead > ClusterSize)
+			uint64_t clusterStart = i * ClusterSize;
+			uint64_t from = (offset > clusterStart) ? (offset - clusterStart) : 0;
+			uint64_t to = (end < clusterStart + ClusterSize) ? (end - clusterStart) : ClusterSize;
+
+			if (from != 0)
 			{
-				toRead = ClusterSize;
-				ReadCluster(clus, buff);
+				//Only the first cluster can start in the middle, the part before the offset is skipped and the rest is read in place
+				IOSegment head[] = { { nullptr, from }, { buff, to - from } };
+				if (cache->ReadVector(device, GetClusterOffset(clus), head, 2, ClusterSize) != 0)
+				{
+					return -1;
+				}
 			}
 			else
 			{
-				uint8_t* temporary = new uint8_t[ClusterSize];
-				ReadCluster(clus, temporary);
-				memcpy(buff, temporary, toRead);
-				delete[] temporary;
+				//The rest are read straight into the buffer in one batch, the last one only partially
+				//Clusters that follow each other both on the disk and in the buffer are merged into a single request
+				uint64_t physical = GetClusterOffset(clus);
+				BlockIO* previous = (requests.size() > 0) ? &requests.back() : nullptr;
+				if (previous && (previous->offset + previous->size) == physical && ((uint8_t*)previous->buffer + previous->size) == buff
+					&& (previous->size % ClusterSize) == 0 && (previous->size + to) <= cache->GetMaxTransfer())
+				{
+					previous->size += to;
+				}
+				else
+				{
+					requests.push_back({ physical, buff, to });
+				}
 			}
 
-			buff += ClusterSize;
-			bytes_so_far += toRead;
+			buff += to - from;
 		}
 
-		return 0;
+		if (requests.size() == 0)
+		{
+			return 0;
+		}
+
+		return cache->ReadBatch(device, requests.data(), (uint32_t)requests.size(), ClusterSize);
 	}
 
-	int exFATDriver::WriteFile(DirEntry fileMeta, uint64_t offset, void* buffer, uint64_t bytes)
+	int exFATDriver::WriteFile(const DirEntry& fileMeta, uint64_t offset, void* buffer, uint64_t bytes)
 	{
 		if ((fileMeta.attributes & FILE_DIRECTORY) == FILE_DIRECTORY)
 		{
 			return -3;
 		}
 
-		if ((bytes + offset) > fileMeta.size)
+		DirEntry modified = fileMeta;
+		if ((bytes + offset) > modified.size)
 		{
-			fileMeta.size = bytes + offset;
+			modified.size = bytes + offset;
 
-			uint32_t new_cluster_size = fileMeta.size / ClusterSize;
-			if ((new_cluster_size * ClusterSize) != fileMeta.size)
+			uint32_t new_cluster_size = modified.size / ClusterSize;
+			if ((new_cluster_size * ClusterSize) != modified.size)
 			{
 				new_cluster_size++;
 			}
@@ -869,61 +1227,168 @@ namespace exFAT
 			ResizeClusterChain(fileMeta.cluster, new_cluster_size);
 		}
 
-		std::vector<uint32_t> chain = GetClusterChain(fileMeta.cluster);
+		const ExtentMap& map = GetExtentMap(fileMeta.cluster);
+
+		//A write starting past the end of the file leaves a gap, it has to read back as zeros and not as whatever the clusters held before
+		if (offset > fileMeta.size && ClearFileRange(map, fileMeta.size, offset) != 0)
+		{
+			return -1;
+		}
+
+		//Only the clusters covering [offset, offset + bytes) are touched, the extent map takes us straight to the first one
+		uint64_t end = offset + bytes;
+		uint64_t first = offset / ClusterSize;
+		uint64_t last = (bytes == 0) ? 0 : (end - 1) / ClusterSize;
 
-		uint64_t bytes_so_far = 0;
 		uint8_t* buff = (uint8_t*)buffer;
-		for (uint32_t i = 0; i < chain.size(); i++)
+		for (uint64_t i = first; bytes && i <= last; i++)
 		{
-			uint32_t clus = chain[i];
+			uint32_t clus = (uint32_t)map.Lookup(i);
+			if (clus == 0)
+			{
+				return -1;
+			}
+
+			uint64_t clusterStart = i * ClusterSize;
+			uint64_t from = (offset > clusterStart) ? (offset - clusterStart) : 0;
+			uint64_t to = (end < clusterStart + ClusterSize) ? (end - clusterStart) : ClusterSize;
 
-			if (bytes_so_far < offset)
+			if (from == 0 && to == ClusterSize)
 			{
-				bytes_so_far += ClusterSize;
+				//Whole clusters are written together with the ones following them on the disk
+				uint64_t contiguous = 0;
+				map.Lookup(i, &contiguous);
+
+				uint64_t count = (end - clusterStart) / ClusterSize;
+				if (count > contiguous)
+				{
+					count = contiguous;
+				}
+
+				if (WriteClusterRun(clus, (uint32_t)count, buff) != 0)
+				{
+					return -1;
+				}
+
+				i += count - 1;
+				buff += count * ClusterSize;
 				continue;
 			}
-
-			uint64_t toWrite = (bytes + offset) - bytes_so_far;
-			if (toWrite > ClusterSize)
+			else if (!writeBack)
 			{
-				toWrite = ClusterSize;
-				WriteCluster(clus, buff);
+				//Partially written clusters are written in place, the bytes outside the written range are skipped
+				//Only the part past the end of the file is cleared
+				uint64_t fileEnd = modified.size - clusterStart;
+				if (fileEnd > ClusterSize)
+				{
+					fileEnd = ClusterSize;
+				}
+
+				ScratchBuffer temporaryBuffer(*scratch);
+				IOSegment segments[4];
+				uint32_t count = 0;
+				segments[count++] = { nullptr, from };
+				segments[count++] = { buff, to - from };
+				if (fileEnd > to)
+				{
+					segments[count++] = { nullptr, fileEnd - to };
+				}
+
+				if (fileEnd < ClusterSize)
+				{
+					memset(temporaryBuffer, 0, ClusterSize - fileEnd);
+					segments[count++] = { temporaryBuffer, ClusterSize - fileEnd };
+				}
+
+				if (cache->WriteVector(device, GetClusterOffset(clus), segments, count, ClusterSize) != 0)
+				{
+					return -1;
+				}
 			}
 			else
 			{
-				uint8_t* temporary = new uint8_t[ClusterSize];
-				memset(temporary, 0, ClusterSize);
-				memcpy(temporary, buff, toWrite);
-				WriteCluster(clus, temporary);
-				delete[] temporary;
+				//In write-back mode the whole cluster has to be in the cache, it keeps whatever it had outside the written range
+				//The part past the end of the file is cleared
+				ScratchBuffer temporaryBuffer(*scratch);
+				uint8_t* data = GetCluster(clus, temporaryBuffer);
+				memcpy(data + from, buff, to - from);
+
+				if (clusterStart + ClusterSize > modified.size)
+				{
+					uint64_t fileEnd = modified.size - clusterStart;
+					memset(data + fileEnd, 0, ClusterSize - fileEnd);
+				}
+
+				if (WriteCluster(clus, data, BlockKind::Data) != 0)
+				{
+					return -1;
+				}
+			}
+
+			buff += to - from;
+		}
+
+		ModifyDirectoryEntry(fileMeta.parentCluster, fileMeta.name, modified);
+
+		SyncIfNeeded();
+		return 0;
+	}
+
+	int exFATDriver::ClearFileRange(const ExtentMap& map, uint64_t from, uint64_t to)
+	{
+		ScratchBuffer temporaryBuffer(*scratch);
+
+		for (uint64_t i = from / ClusterSize; from < to; i++)
+		{
+			uint32_t clus = (uint32_t)map.Lookup(i);
+			if (clus == 0)
+			{
+				return -1;
+			}
+
+			uint64_t clusterStart = i * ClusterSize;
+			uint64_t start = from - clusterStart;
+			uint64_t stop = (to < clusterStart + ClusterSize) ? (to - clusterStart) : ClusterSize;
+
+			//Whole clusters are simply overwritten, the rest of a partial one is kept
+			uint8_t* data = temporaryBuffer;
+			if (start != 0 || stop != ClusterSize)
+			{
+				data = GetCluster(clus, temporaryBuffer);
+			}
+
+			memset(data + start, 0, stop - start);
+			if (WriteCluster(clus, data, BlockKind::Data) != 0)
+			{
+				return -1;
 			}
 
-			buff += ClusterSize;
-			bytes_so_far += toWrite;
+			from = clusterStart + stop;
 		}
 
-		ModifyDirectoryEntry(fileMeta.parentCluster, fileMeta.name, fileMeta);
 		return 0;
 	}
 
-	int exFATDriver::ResizeFile(DirEntry fileMeta, uint32_t new_size)
+	int exFATDriver::ResizeFile(const DirEntry& fileMeta, uint32_t new_size)
 	{
 		if ((fileMeta.attributes & FILE_DIRECTORY) == FILE_DIRECTORY)
 		{
 			return -3;
 		}
 
-		fileMeta.size = new_size;
+		DirEntry modified = fileMeta;
+		modified.size = new_size;
 
-		uint32_t new_cluster_size = fileMeta.size / ClusterSize;
-		if ((new_cluster_size * ClusterSize) != fileMeta.size)
+		uint32_t new_cluster_size = modified.size / ClusterSize;
+		if ((new_cluster_size * ClusterSize) != modified.size)
 		{
 			new_cluster_size++;
 		}
 
 		ResizeClusterChain(fileMeta.cluster, new_cluster_size);
-		ModifyDirectoryEntry(fileMeta.parentCluster, fileMeta.name, fileMeta);
+		ModifyDirectoryEntry(fileMeta.parentCluster, fileMeta.name, modified);
 
+		SyncIfNeeded();
 		return 0;
 	}
 };
@@ -2,8 +2,18 @@
 #define EX_FAT_DRIVER_H
 
 #include "exFATdefs.h"
-
+#include "BlockDevice.h"
+#include "BufferCache.h"
+#include "FATCache.h"
+#include "ExtentMap.h"
+#include "ScratchPool.h"
+#include "Readahead.h"
+#include "DirectoryIndex.h"
+#include "DentryCache.h"
+
+#include <functional>
 #include <map>
+#include <unordered_map>
 #include <vector>
 
 #include "Bitmap.h"
@@ -13,37 +23,69 @@ namespace exFAT
 	class exFATDriver
 	{
 	public:
-		exFATDriver(const std::string& image);
+		exFATDriver(const std::string& image, BlockDeviceType type = BlockDeviceType::File);
 		~exFATDriver();
 
+		//False if the image couldn't be opened, nothing else may be called then
+		bool IsOpen() const { return device != nullptr; }
+
 		//if exclude is true, we only give back entries with filter_attributes as their attributes
 		//otherwise, we ignore entries that have filter_attributes set
 		std::vector<DirEntry> GetDirectories(uint32_t cluster, uint32_t filter_attributes, bool exclude);
 
-		void ModifyDirectoryEntry(uint32_t cluster, const char* name, DirEntry modified);
+		//Calls callback with every entry of the directory, in order, decoding them one at a time
+		//Returning false from callback stops the walk, the callback mustn't modify the directory
+		void ForEachEntry(uint32_t cluster, const std::function<bool(const DirEntry&)>& callback);
+
+		void ModifyDirectoryEntry(uint32_t cluster, const char* name, const DirEntry& modified);
 
 		int PrepareAddedDirectory(uint32_t cluster);
-		void CleanFileEntry(uint32_t cluster, DirEntry entry);
+		void CleanFileEntry(uint32_t cluster, const DirEntry& entry);
 
 		int DirectorySearch(const char* FilePart, uint32_t cluster, DirEntry* file);
-		int DirectoryAdd(uint32_t cluster, DirEntry file);
+		int DirectoryAdd(uint32_t cluster, const DirEntry& file);
 
 		int OpenFile(const char* filePath, DirEntry* fileMeta);
 		int CreateFile(const char* filePath, DirEntry* fileMeta);
-		int DeleteFile(DirEntry entry);
+		int DeleteFile(const DirEntry& entry);
+
+		int ReadFile(const DirEntry& fileMeta, uint64_t offset, void* buffer, uint64_t bytes);
+		int WriteFile(const DirEntry& fileMeta, uint64_t offset, void* buffer, uint64_t bytes);
+		int ResizeFile(const DirEntry& fileMeta, uint32_t new_size);
+
+		//Writes everything that's been buffered: the file data, then the FAT, then the directory entries
+		int Sync();
 
-		int ReadFile(DirEntry fileMeta, uint64_t offset, void* buffer, uint64_t bytes);
-		int WriteFile(DirEntry fileMeta, uint64_t offset, void* buffer, uint64_t bytes);
-		int ResizeFile(DirEntry fileMeta, uint32_t new_size);
+		//With write-back on (the default), cluster and FAT writes are only buffered until Sync, the dirty threshold or closing
+		void SetWriteBack(bool enabled);
+		bool GetWriteBack() const { return writeBack; }
 
 	private:
 		uint32_t ReadFAT(uint32_t cluster);
 		uint32_t WriteFAT(uint32_t cluster, uint32_t value);
 
 		uint32_t ReadCluster(uint32_t cluster, void* buffer);
-		uint32_t WriteCluster(uint32_t cluster, void* buffer);
+		uint32_t WriteCluster(uint32_t cluster, void* buffer, BlockKind kind = BlockKind::Metadata);
+		//Writes count physically consecutive clusters of file data, with as few device writes as the transfer limit allows
+		uint32_t WriteClusterRun(uint32_t cluster, uint32_t count, void* buffer);
 
+		//Returns the cluster's data, pointing straight into the image if it's memory mapped, otherwise it's read into buffer
+		uint8_t* GetCluster(uint32_t cluster, void* buffer);
+		uint64_t GetClusterOffset(uint32_t cluster);
+
+		//A chain without FAT entries (NoFatChain set in its stream entry) is the clusters its length covers from start
 		std::vector<uint32_t> GetClusterChain(uint32_t start);
+		uint64_t GetContiguousCount(uint32_t start, uint64_t length);
+
+		//The chain starting at start as extents, it's only walked the first time, until the chain is resized or freed
+		const ExtentMap& GetExtentMap(uint32_t start);
+		void InvalidateExtentMap(uint32_t start);
+
+		//Zeroes the bytes [from, to) of the file mapped by map, its clusters have to be allocated already
+		int ClearFileRange(const ExtentMap& map, uint64_t from, uint64_t to);
+
+		//Prefetches the clusters ahead of a read of the file, if its reads have been sequential so far
+		void ReadAhead(const DirEntry& fileMeta, const ExtentMap& map, uint64_t offset, uint64_t bytes);
 
 		uint32_t AllocateClusterChain(uint32_t size);
 		void FreeClusterChain(uint32_t start);
@@ -55,16 +97,41 @@ namespace exFAT
 		void GetDirectoriesOnCluster(uint32_t cluster, std::vector<DirEntry>& entries);
 		uint32_t GetClusterFromFilePath(const char* filePath, DirEntry* entry);
 
+		void SyncIfNeeded();
+
 		static uint8_t GetMilliseconds();
 		static uint16_t GetTime();
 		static uint16_t GetDate();
 
 	private:
-		std::fstream file;
+		BlockDevice* device = nullptr;
+		BufferCache* cache;
+
+		//Cluster sized buffers for partial cluster I/O and directory updates
+		ScratchPool* scratch = nullptr;
+		FATCache* FATcache = nullptr;
+
+		//Extent maps of the files accessed, keyed by their first cluster
+		std::unordered_map<uint32_t, ExtentMap> extentMaps;
+		static const uint32_t MaxExtentMaps = 256;
+
+		//Sequential read detection, keyed by the files' first cluster
+		Readahead readahead;
+
+		//The device requests of a ReadFile, kept so it only allocates while the reads keep getting bigger
+		std::vector<BlockIO> readRequests;
+
+		//Lengths of the files and directories whose clusters are consecutive (no FAT chain), keyed by their first cluster
+		//They're found when their directory is walked, which always happens before they're opened
+		std::unordered_map<uint32_t, uint64_t> contiguousChains;
+
+		//Entries of the directories searched, keyed by the directories' first cluster
+		DirectoryIndex<DirEntry> directoryIndex;
+
+		//Path components resolved lately (and the ones that weren't found), keyed by the directory's first cluster
+		DentryCache<DirEntry> dentries;
 
-		uint8_t* temporaryBuffer;
-		uint8_t* temporaryBuffer2;
-		uint8_t* FATcache;
+		bool writeBack = true;
 
 		char VolumeLabel[11] = { 0 };
 		 
@@ -72,7 +139,7 @@ namespace exFAT
 		BitmapEntry* bitmapEntry2 = nullptr;
 		Bitmap AllocationBitmap;
 
-		exFAT_BootSector* BootSector;
+		exFAT_BootSector* BootSector = nullptr;
 
 		uint32_t SectorSize;
 		uint32_t SectorsPerCluster;
@@ -18,6 +18,45 @@ outputdir = "%{cfg.buildcfg}-%{cfg.system}-%{cfg.architecture}"
 
 group "Drivers"
 
+project "Common"
+    location "Common"
+    kind "StaticLib"
+    language "C++"
+    cppdialect "C++17"
+    staticruntime "off"
+    
+    targetdir ("bin/" .. outputdir .. "/%{prj.name}")
+    objdir ("bin-int/" .. outputdir .. "/%{prj.name}")
+
+    files
+    {
+        "%{prj.name}/src/**.h",
+        "%{prj.name}/src/**.cpp"
+    }
+
+    defines
+	{
+		"_CRT_SECURE_NO_WARNINGS"
+    }
+
+    includedirs
+    {
+        "%{prj.location}/src"
+    }
+    
+    filter "system:windows"
+        systemversion "latest"
+    
+    filter "configurations:Debug"
+        defines "DEBUG"
+        runtime "Debug"
+        symbols "on"
+    
+    filter "configurations:Release"
+        defines "RELEASE"
+        runtime "Release"
+        optimize "on"
+
 project "FAT32"
     location "FAT32"
     kind "StaticLib"
@@ -41,7 +80,13 @@ project "FAT32"
 
     includedirs
     {
-        "%{prj.location}/src"
+        "%{prj.location}/src",
+        "Common/src"
+    }
+
+    links
+    {
+        "Common"
     }
     
     filter "system:windows"
@@ -80,7 +125,13 @@ project "Ext2"
 
     includedirs
     {
-        "%{prj.location}/src"
+        "%{prj.location}/src",
+        "Common/src"
+    }
+
+    links
+    {
+        "Common"
     }
     
     filter "system:windows"
@@ -119,7 +170,13 @@ project "exFAT"
 
     includedirs
     {
-        "%{prj.location}/src"
+        "%{prj.location}/src",
+        "Common/src"
+    }
+
+    links
+    {
+        "Common"
     }
     
     filter "system:windows"
@@ -158,7 +215,8 @@ project "Test"
         "%{prj.location}/src",
         "FAT32/src",
         "Ext2/src",
-        "exFAT/src"
+        "exFAT/src",
+        "Common/src"
     }
 
     defines
@@ -170,7 +228,8 @@ project "Test"
     {
         "FAT32",
         "Ext2",
-        "exFAT"
+        "exFAT",
+        "Common"
     }
 
     filter "system:windows"